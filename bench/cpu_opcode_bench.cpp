@@ -0,0 +1,114 @@
+// Per-opcode CPU microbenchmark: runs each straight-line official opcode from
+// RAM through CPU::step() and prints the average time per instruction.
+//
+//   cpu_opcode_bench [rounds]   (each round is 64 copies of the opcode + JMP)
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include "bus.h"
+
+namespace {
+
+const uint16_t program_start = 0x0400;
+const int instructions_per_round = 64;
+
+Bus bus;
+
+// Zero page is filled with $03 so every indirect pointer lands on $0303 and
+// direct operands point at $80 / $0300. Only the benchmarked opcode runs, so
+// no store can reach the pointers it uses or the program itself.
+void build_ram(uint8_t opcode, uint8_t* image) {
+    const CPU::Instruction& instruction = CPU::instruction_table[opcode];
+    std::memset(image, 0x00, 2048);
+    std::memset(image, 0x03, 0x100);
+
+    uint16_t operand = 0x0000;
+    switch (instruction.mode) {
+    case CPU::Mode::IMM:
+        operand = 0x5A;
+        break;
+    case CPU::Mode::ZP0:
+    case CPU::Mode::ZPX:
+    case CPU::Mode::ZPY:
+        operand = 0x80;
+        break;
+    case CPU::Mode::IZX:
+    case CPU::Mode::IZY:
+        operand = 0x10;
+        break;
+    default:
+        operand = 0x0300;
+        break;
+    }
+
+    uint16_t pc = program_start;
+    const uint8_t length = 1 + CPU::operand_bytes(instruction.mode);
+    for (int i = 0; i < instructions_per_round; i++) {
+        image[pc] = opcode;
+        if (length > 1) {
+            image[pc + 1] = operand & 0xFF;
+        }
+        if (length > 2) {
+            image[pc + 2] = operand >> 8;
+        }
+        pc += length;
+    }
+    image[pc] = 0x4C;
+    image[pc + 1] = program_start & 0xFF;
+    image[pc + 2] = program_start >> 8;
+}
+
+bool benchmarked(uint8_t opcode) {
+    const CPU::Instruction& instruction = CPU::instruction_table[opcode];
+    switch (instruction.kind) {
+    case CPU::Kind::READ:
+    case CPU::Kind::MODIFY:
+    case CPU::Kind::STORE:
+        return true;
+    case CPU::Kind::IMPLIED:
+        // BRK/RTI/RTS leave the straight-line program.
+        return opcode != 0x00 && opcode != 0x40 && opcode != 0x60;
+    default:
+        return false;
+    }
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const int rounds = argc > 1 ? std::atoi(argv[1]) : 20000;
+    uint8_t image[2048];
+    double total_ns = 0.0;
+    int count = 0;
+
+    std::printf("opcode name mode  ns/instr\n");
+    for (int opcode = 0; opcode < 256; opcode++) {
+        if (!benchmarked(static_cast<uint8_t>(opcode))) {
+            continue;
+        }
+        build_ram(static_cast<uint8_t>(opcode), image);
+
+        std::memcpy(bus.get_ram(), image, sizeof(image));
+        bus.cpu.reset();
+        bus.cpu.set_pc(program_start);
+
+        // The program loops with JMP, which is counted as one more instruction.
+        const long steps = static_cast<long>(rounds) * (instructions_per_round + 1);
+        const auto start = std::chrono::steady_clock::now();
+        for (long i = 0; i < steps; i++) {
+            bus.cpu.step();
+        }
+        const auto elapsed = std::chrono::steady_clock::now() - start;
+
+        const double ns = std::chrono::duration<double, std::nano>(elapsed).count() / steps;
+        const CPU::Instruction& instruction = CPU::instruction_table[opcode];
+        std::printf("  $%02X  %s  %s  %8.2f\n", opcode, instruction.name,
+                    CPU::mode_name(instruction.mode), ns);
+        total_ns += ns;
+        count++;
+    }
+    std::printf("average over %d opcodes: %.2f ns/instr\n", count, total_ns / count);
+    return 0;
+}
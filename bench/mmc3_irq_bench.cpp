@@ -0,0 +1,113 @@
+// MMC3 IRQ line benchmark: clocks the PPU with rendering on and the scanline
+// counter raising IRQ every few lines, once polling the mapper and updating
+// the CPU's IRQ input after every dot (what Bus did before mappers pushed
+// their transitions) and once relying on the transition callback alone.
+//
+//   mmc3_irq_bench [rom] [frames]   (defaults: nestest.nes, 600)
+//
+// The ROM's header is patched to mapper 4, like mapper_bench does.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <string>
+#include <vector>
+#include "bus.h"
+
+namespace {
+
+Bus bus;
+
+const int dots_per_frame = 262 * 341;
+const uint8_t irq_latch = 7;
+const int rounds = 5;
+
+struct Result {
+    double ms_per_frame;
+    long irqs;
+};
+
+Result run(Cartridge& cart, bool poll, int frames) {
+    bus.insert_cartridge(&cart);
+    bus.ppu.reset();
+    // Sprites on every line: the PPU only fetches patterns of sprites in
+    // range, and those fetches from $1000 are what the counter sees.
+    for (int i = 0; i < 64; i++) {
+        bus.ppu.oam[i * 4 + 0] = static_cast<uint8_t>(i * 4);
+        bus.ppu.oam[i * 4 + 1] = static_cast<uint8_t>(i);
+        bus.ppu.oam[i * 4 + 2] = 0x00;
+        bus.ppu.oam[i * 4 + 3] = static_cast<uint8_t>(i * 4);
+    }
+    bus.ppu.cpu_write(0x0000, 0x08);
+    bus.ppu.cpu_write(0x0001, 0x18);
+    cart.cpu_write(0xC000, irq_latch);
+    cart.cpu_write(0xC001, 0x00);
+    cart.cpu_write(0xE001, 0x00);
+
+    long irqs = 0;
+    const auto start = std::chrono::steady_clock::now();
+    for (int line = 0; line < frames * 262; line++) {
+        if (poll) {
+            for (int dot = 0; dot < 341; dot++) {
+                bus.ppu.clock();
+                bus.set_cartridge_irq_line(cart.irq_asserted());
+            }
+        } else {
+            for (int dot = 0; dot < 341; dot++) {
+                bus.ppu.clock();
+            }
+        }
+        // The handler a game would run: acknowledge and re-enable.
+        if (cart.irq_asserted()) {
+            cart.cpu_write(0xE000, 0x00);
+            cart.cpu_write(0xE001, 0x00);
+            irqs++;
+        }
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return {std::chrono::duration<double, std::milli>(elapsed).count() / frames, irqs};
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const std::string rom_path = argc > 1 ? argv[1] : "nestest.nes";
+    const int frames = argc > 2 ? std::atoi(argv[2]) : 600;
+
+    std::ifstream rom_file(rom_path, std::ios::binary);
+    std::vector<char> rom((std::istreambuf_iterator<char>(rom_file)), std::istreambuf_iterator<char>());
+    if (rom.size() < 16) {
+        std::fprintf(stderr, "Could not read %s\n", rom_path.c_str());
+        return 1;
+    }
+    rom[6] = static_cast<char>((rom[6] & 0x0F) | 0x40);
+    rom[7] = static_cast<char>(rom[7] & 0x0F);
+    const std::string patched_path = (std::filesystem::temp_directory_path() / "emunes_mmc3_irq_bench.nes").string();
+    {
+        std::ofstream out(patched_path, std::ios::binary);
+        out.write(rom.data(), static_cast<std::streamsize>(rom.size()));
+    }
+
+    // Alternating rounds, best of each, to keep scheduling noise out.
+    Cartridge cart(patched_path);
+    Result polled = run(cart, true, frames);
+    Result pushed = run(cart, false, frames);
+    for (int round = 1; round < rounds; round++) {
+        const Result p = run(cart, true, frames);
+        const Result q = run(cart, false, frames);
+        polled.ms_per_frame = std::min(polled.ms_per_frame, p.ms_per_frame);
+        pushed.ms_per_frame = std::min(pushed.ms_per_frame, q.ms_per_frame);
+    }
+    std::remove(patched_path.c_str());
+
+    std::printf("                 ms/frame  IRQ line updates/frame\n");
+    std::printf("  polled       %8.3f  %8d\n", polled.ms_per_frame, dots_per_frame);
+    std::printf("  pushed       %8.3f  %8.1f\n", pushed.ms_per_frame, 2.0 * pushed.irqs / frames);
+    std::printf("  speedup       %6.2fx%s\n", polled.ms_per_frame / pushed.ms_per_frame,
+                polled.irqs == pushed.irqs ? "" : "  (IRQ counts differ)");
+    return 0;
+}
@@ -1,6 +1,7 @@
 #ifndef APU_H
 #define APU_H
 #include <cstdint>
+#include <vector>
 
 class Bus;
 
@@ -13,23 +14,45 @@ public:
     void cpu_write(uint16_t address, uint8_t data);
     uint8_t cpu_read(uint16_t address);
     void clock();
+    // Same as `cycles` calls to clock(); channel timers are advanced in
+    // stretches between frame counter steps and output samples.
+    void run(uint32_t cycles);
     float get_output_sample();
     void reset();
 
     bool sample_ready = false;
     float output_sample = 0.0f;
+    // Every output sample is also appended here, for callers that run the
+    // APU in batches (Bus::run_until) and would miss sample_ready.
+    void set_sample_log(std::vector<float>* log) { sample_log = log; }
+
+    // Cycles until the frame counter or the DMC can next raise IRQ, counting
+    // the next cycle as 1; a lower bound for the DMC, no_irq if they cannot.
+    static constexpr uint32_t no_irq = UINT32_MAX;
+    uint32_t cycles_until_frame_irq() const;
+    uint32_t cycles_until_dmc_irq() const;
+
+    // Debug log of the level the APU drives its IRQ line to, every time it does.
+    void set_irq_log(std::vector<bool>* log) { irq_log = log; }
+    // Name of the first part of the channel, frame counter or filter state
+    // that differs from `other`, nullptr if none does.
+    const char* state_difference(const APU& other) const;
 
 private:
     Bus* bus = nullptr;
+    std::vector<float>* sample_log = nullptr;
+    std::vector<bool>* irq_log = nullptr;
     uint64_t frame_clock_counter = 0;
     bool frame_counter_mode = false;
     bool irq_inhibit = false;
     bool frame_interrupt = false;
     bool even_cycle = false;
 
-    double global_time = 0.0;
-    const double time_per_clock = 1.0 / 1789773.0;
-    const double time_per_sample = 1.0 / 44100.0;
+    static constexpr uint32_t cpu_clock_rate = 1789773;
+    static constexpr uint32_t sample_rate = 44100;
+    // Advances by sample_rate per cycle, a sample is due at cpu_clock_rate.
+    uint32_t sample_clock = 0;
+    const double time_per_sample = 1.0 / sample_rate;
     double hp_90_state = 0.0;
     double hp_440_state = 0.0;
     double lp_14000_state = 0.0;
@@ -119,6 +142,7 @@ private:
     void clock_noise();
     void clock_envelope_noise();
     void clock_dmc();
+    void clock_dmc_output();
     bool pulse_muted(const PulseChannel& p, bool ones_complement) const;
     void update_sweep_target(PulseChannel& p, bool ones_complement);
     void clock_quarter_frame();
@@ -131,9 +155,15 @@ private:
     float get_dmc_output() const;
     float apply_filter_chain(float sample);
     float mix_sample();
+    void update_irq_line();
     
     void clock_triangle_length();
     void clock_noise_length();
+
+    uint32_t cycles_until_frame_step() const;
+    void run_channels(uint32_t cycles);
+    void run_noise(uint32_t clocks);
+    void run_dmc(uint32_t cycles);
 };
 
 #endif
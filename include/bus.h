@@ -5,14 +5,65 @@
 #include <ppu.h>
 #include <cartridge.h>
 #include <controller.h>
+#include <scheduler.h>
+#include <array>
+#include <vector>
 
 class Bus{
 public:
+    // One 256-byte page of the CPU address space: a host pointer for RAM,
+    // PRG ROM and PRG RAM, or a handler for registers and unmapped space.
+    struct MemoryPage {
+        const uint8_t* read;
+        uint8_t* write;
+        uint8_t (*read_handler)(Bus& bus, uint16_t address);
+        void (*write_handler)(Bus& bus, uint16_t address, uint8_t data);
+    };
+
     Bus();
     void clock();
+    void run_until(uint64_t timestamp);
+    uint64_t get_timestamp() const { return system_clock_counter; }
+    uint8_t* get_ram() { return cpu_ram.data(); }
+
+    // The PPU and APU run behind the CPU and are caught up on register
+    // accesses and scheduled events. begin_cpu_cycle() brings every component
+    // with a due event up to the CPU.
+    void begin_cpu_cycle() {
+        if (system_clock_counter >= scheduler.next_event()) {
+            run_events();
+        }
+    }
+    int64_t end_cpu_cycles(uint8_t cycles);
+    // Master clock timestamp of the earliest scheduled event, Scheduler::never if none.
+    uint64_t next_event() const { return scheduler.next_event(); }
+    // Run the PPU up to (not including) the dot at `timestamp`, the APU up to
+    // the CPU cycle at `timestamp`.
+    void sync_ppu(uint64_t timestamp);
+    void sync_apu(uint64_t timestamp);
 
-    void cpu_write(uint16_t address, uint8_t data);
-    uint8_t cpu_read(uint16_t address);
+    void cpu_write(uint16_t address, uint8_t data) {
+        const MemoryPage& page = pages[address >> 8];
+        if (page.write) {
+            page.write[address & 0x00FF] = data;
+        } else {
+            page.write_handler(*this, address, data);
+        }
+    }
+    uint8_t cpu_read(uint16_t address) {
+        const MemoryPage& page = pages[address >> 8];
+        return page.read ? page.read[address & 0x00FF] : page.read_handler(*this, address);
+    }
+    uint8_t peek(uint16_t address);
+
+    // Debug log of every read served by the PPU and I/O registers, used to
+    // check lazy catch-up against dot-by-dot stepping.
+    struct RegisterRead {
+        uint64_t timestamp;
+        uint16_t address;
+        uint8_t data;
+    };
+    void set_register_log(std::vector<RegisterRead>* log) { register_log = log; }
     
     bool ppu_read(uint16_t address, uint8_t& data);
     bool ppu_write(uint16_t address, uint8_t data);
@@ -29,17 +80,52 @@ public:
     void set_cartridge_irq_line(bool asserted);
     
 private:
+    void clock_dma();
+    int64_t run_dma();
+    void run_events();
+    void advance_ppu(uint64_t timestamp);
+    void advance_apu(uint64_t timestamp);
+    void run_apu(uint64_t timestamp);
+    void schedule_ppu();
+    void schedule_apu();
+    void map_cartridge();
+    void map_prg_rom();
+
+    static uint8_t read_ppu(Bus& bus, uint16_t address);
+    static uint8_t read_io(Bus& bus, uint16_t address);
+    static uint8_t read_cartridge(Bus& bus, uint16_t address);
+    static void write_ppu(Bus& bus, uint16_t address, uint8_t data);
+    static void write_io(Bus& bus, uint16_t address, uint8_t data);
+    static void write_cartridge(Bus& bus, uint16_t address, uint8_t data);
+    static void cartridge_irq(void* bus, bool asserted);
+
+    std::array<MemoryPage, 256> pages{};
+    // PRG bank generation the $8000-$FFFF pages were last mapped for.
+    uint32_t prg_generation = 0;
+
     std::array<uint8_t, 2048> cpu_ram;
     uint64_t system_clock_counter = 0;
+    // Master clock position of the next CPU cycle within Bus::clock().
+    uint8_t cpu_phase = 0;
+    Scheduler scheduler;
+    std::vector<RegisterRead>* register_log = nullptr;
+    uint64_t ppu_timestamp = 0;
+    uint64_t apu_timestamp = 0;
+    // Channel register writes wait here until the APU catches up to them;
+    // nothing the CPU can see changes before that.
+    struct ApuWrite {
+        uint64_t timestamp;
+        uint16_t address;
+        uint8_t data;
+    };
+    std::array<ApuWrite, 32> apu_writes{};
+    size_t apu_write_count = 0;
 
     bool dma_transfer = false;
     bool dma_dummy = true;
     uint8_t dma_page = 0x00;
     uint8_t dma_addr = 0x00;
     uint8_t dma_data = 0x00;
-
-    bool apu_irq_line = false;
-    bool cartridge_irq_line = false;
     
 };
 
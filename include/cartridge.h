@@ -2,9 +2,12 @@
 #define CARTRIDGE_H
 
 #include <cstdint>
+#include <memory>
 #include <string>
 #include <vector>
 
+class Mapper;
+
 class Cartridge {
 public:
     
@@ -14,54 +17,66 @@ public:
          FOUR_SCREEN,
          ONESCREEN_LO,
          ONESCREEN_HI,
-     } mirror = HORIZONTAL;
+     };
     
     Cartridge(const std::string& filename);
+    ~Cartridge();
 
     bool cpu_read(uint16_t address, uint8_t& data);
     bool cpu_write(uint16_t address, uint8_t data);
+
+    // Offset of a $8000-$FFFF address in PRG ROM. Banks are switched in 8KB
+    // windows or larger, so offsets stay contiguous within an 8KB window.
+    bool prg_rom_offset(uint16_t address, size_t& offset) const;
+    const uint8_t* prg_rom() const { return prg_memory.data(); }
+    size_t prg_rom_size() const { return prg_memory.size(); }
+    uint8_t* prg_ram_data() { return prg_ram.data(); }
+    size_t prg_ram_size() const { return prg_ram.size(); }
+    // Bumped on every write that may remap PRG ROM.
+    uint32_t get_prg_bank_generation() const { return prg_bank_generation; }
     
     bool ppu_read(uint16_t address, uint8_t& data);
     bool ppu_write(uint16_t address, uint8_t data);
 
+    // The 8 pixels of a pattern table row from its two bit planes, two bits
+    // each with the leftmost pixel on top, or mirrored for `flip`.
+    static uint16_t decode_chr_row(uint8_t lo, uint8_t hi, bool flip);
+
     bool irq_asserted() const;
+
+    // Points the PPU's four 1KB nametable pages into its 2KB `ciram`, or the
+    // cartridge's own VRAM, for the mirroring in effect, and again every time
+    // that changes. nullptr disconnects.
+    void connect_nametables(uint8_t* ciram, uint8_t** pages);
+    MIRROR get_mirroring() const { return mirror; }
+    void set_mirroring(MIRROR mode);
+
+    Mapper* get_mapper() const { return mapper.get(); }
+    uint8_t get_mapper_id() const { return mapper_id; }
     
 private:
     std::vector<uint8_t> prg_memory;
     std::vector<uint8_t> chr_memory;
+    // decode_chr_row() of every CHR row, plain and flipped, at the offset of
+    // its tile plus 2 * row; kept current by CHR RAM writes.
+    std::vector<uint16_t> chr_rows;
     std::vector<uint8_t> prg_ram;
+    // The two extra nametables of four-screen boards.
+    std::vector<uint8_t> vram;
+    MIRROR mirror = HORIZONTAL;
+    uint8_t* ciram = nullptr;
+    uint8_t** nametable_pages = nullptr;
     
     uint8_t mapper_id = 0;
     uint8_t prg_banks = 0;
     uint8_t chr_banks = 0;
+    uint32_t prg_bank_generation = 0;
+    std::unique_ptr<Mapper> mapper;
 
-    // Mapper 1 (MMC1) state
-    uint8_t mmc1_shift = 0x10;
-    uint8_t mmc1_control = 0x0C;
-    uint8_t mmc1_chr_bank0 = 0x00;
-    uint8_t mmc1_chr_bank1 = 0x00;
-    uint8_t mmc1_prg_bank = 0x00;
-
-    // Mapper 2 (UxROM) state
-    uint8_t mapper2_prg_bank = 0x00;
-
-    // Mapper 3 (CNROM) state
-    uint8_t mapper3_chr_bank = 0x00;
-
-    // Mapper 4 (MMC3) state
-    uint8_t mmc3_bank_select = 0x00;
-    uint8_t mmc3_bank_regs[8] = {0};
-    uint8_t mmc3_irq_latch = 0x00;
-    uint8_t mmc3_irq_counter = 0x00;
-    bool mmc3_irq_reload = false;
-    bool mmc3_irq_enabled = false;
-    bool mmc3_irq_pending = false;
-    bool mmc3_prev_a12 = false;
+    void decode_chr(size_t offset);
+    void update_nametable_pages();
 
-    void update_mirroring_from_mmc1();
-    size_t map_mmc3_prg(uint16_t address) const;
-    size_t map_mmc3_chr(uint16_t address) const;
-    void mmc3_clock_irq(uint16_t ppu_address);
+    friend class Mapper;
 };
 
 
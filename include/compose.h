@@ -0,0 +1,29 @@
+#ifndef COMPOSE_H
+#define COMPOSE_H
+
+#include <cstdint>
+
+// Background and sprite pixels of a visible line composed into palette
+// indices the way PPU::clock() picks between them, for PPU::clock_line().
+// Per pixel, `bg` holds palette << 2 | pixel and `sprite` 0x10 | palette << 2
+// | pixel, plus 0x20 in front of the background and 0x40 for sprite 0, or 0
+// where no sprite is opaque. The left column masks of PPUMASK `mask` apply.
+// Returns whether sprite 0 was drawn over an opaque background pixel at
+// x 0-254, which is a hit if rendering is on and sprite 0 is on the line.
+using ComposeLine = bool (*)(const uint8_t* bg, const uint8_t* sprite, uint8_t mask, uint8_t* out);
+
+enum ComposeKernel {
+    COMPOSE_SCALAR,
+    COMPOSE_SSE2,
+    COMPOSE_AVX2,
+    COMPOSE_KERNEL_COUNT,
+};
+
+// nullptr if the kernel is not built for or not supported by this CPU.
+ComposeLine compose_kernel(ComposeKernel kernel);
+// The supported kernel that composed a frame's worth of lines fastest when
+// first called, scalar unless another one is at least 10% faster.
+ComposeKernel best_compose_kernel();
+const char* compose_kernel_name(ComposeKernel kernel);
+
+#endif //COMPOSE_H
@@ -1,8 +1,12 @@
 #ifndef CPU_H
 #define CPU_H
 #include <cstdint>
+#include <cstddef>
 #include <unordered_map>
 #include <array>
+#include <vector>
+#include <memory>
+#include <profile.h>
 
 const uint8_t FLAG_N = 0x80; 
 const uint8_t FLAG_V = 0x40;  
@@ -14,43 +18,225 @@ const uint8_t FLAG_Z = 0x02;
 const uint8_t FLAG_C = 0x01;  
 
 class Bus;
+class Cartridge;
+class Jit;
+class Tracer;
+class Sampler;
 
 class CPU {
 public:
+    enum class Mode : uint8_t {
+        IMP, ACC, IMM, ZP0, ZPX, ZPY, ABS, ABX, ABY, IND, IZX, IZY, REL,
+    };
+
+    enum class Kind : uint8_t {
+        READ, MODIFY, STORE, JUMP, IMPLIED, BRANCH, ILLEGAL,
+    };
+
+    using Handler = uint8_t (*)(CPU& cpu, uint16_t operand);
+    using Operation = uint8_t (*)(CPU& cpu, uint8_t value);
+
+    // One entry of the opcode table. The handler receives the already fetched
+    // operand bytes and returns the extra cycles it may cost (page cross,
+    // branch taken); they are only charged when page_penalty is set.
+    // operate is the bare ALU step without any bus traffic, used by the
+    // cycle-stepped core: it consumes a read value, returns a modified or
+    // stored value, or returns the branch condition.
+    struct Instruction {
+        const char* name;
+        Kind kind;
+        Mode mode;
+        uint8_t cycles;
+        bool page_penalty;
+        Handler execute;
+        Operation operate;
+    };
+
+    static const std::array<Instruction, 256> instruction_table;
+    static const char* mode_name(Mode mode);
+    static constexpr uint8_t operand_bytes(Mode mode) {
+        switch (mode) {
+        case Mode::IMP:
+        case Mode::ACC:
+            return 0;
+        case Mode::ABS:
+        case Mode::ABX:
+        case Mode::ABY:
+        case Mode::IND:
+            return 2;
+        default:
+            return 1;
+        }
+    }
+
+    CPU();
+    ~CPU();
+
     void log_status();
     void reset();
     void turn_off();
     void turn_on();
     void clock();
+    int64_t run(int64_t cycles);
+    uint8_t step();
     void connect_bus(Bus* b) { bus = b; }
     void nmi(bool defer_one_instruction = false);
-    void set_irq_line(bool asserted);
+    // Level-triggered IRQ inputs; the CPU looks at them between instructions.
+    enum IrqSource : uint8_t {
+        IRQ_APU = 0x01,
+        IRQ_CARTRIDGE = 0x02,
+    };
+    void set_irq_line(IrqSource source, bool asserted);
     bool is_instruction_complete();
+    uint16_t get_pc() const { return PC; }
+    void set_pc(uint16_t address) { PC = address; }
+    uint8_t get_status() const;
+    // Registers and bus timestamp, for tests that compare two runs.
+    struct State {
+        uint64_t timestamp;
+        uint16_t pc;
+        uint8_t a, x, y, p, sp;
+        bool operator==(const State& other) const {
+            return timestamp == other.timestamp && pc == other.pc && a == other.a && x == other.x &&
+                   y == other.y && p == other.p && sp == other.sp;
+        }
+        bool operator!=(const State& other) const { return !(*this == other); }
+    };
+    State get_state() const;
+    // Debug log of the state at the first instruction of every NMI handler.
+    void set_nmi_log(std::vector<State>* log) { nmi_log = log; }
+    // Runs hot PRG ROM blocks as native code inside run(); instruction-level
+    // core on x86-64 only, otherwise the call is ignored.
+    void set_jit_enabled(bool enabled);
+    // Fast-forwarding of polling loops in run(); it leaves out reads whose
+    // result cannot change, so register read logs differ with it on.
+    void set_idle_skip_enabled(bool enabled) { idle_skip = enabled; }
+    // Records every instruction into the tracer until it is reset to nullptr.
+    // While tracing, run() executes one instruction at a time without the
+    // block cache, the JIT or idle loop skipping.
+    void set_tracer(Tracer* t) { tracer = t; }
+    // Reports every instruction and call/return to the sampler; run() takes
+    // the same one-instruction-at-a-time path as with a tracer.
+    void set_sampler(Sampler* s) { sampler = s; }
+#ifdef EMUNES_PROFILE
+    CpuProfile& get_profile() { return profile; }
+#endif
     
 private:
     
     bool nmi_pending = false;
-    bool nmi_defer_one_instruction = false;
-    bool irq_line = false;
+    uint8_t irq_inputs = 0x00;
     
     uint8_t cycles_left = 0;
+
+    struct DecodedInstruction {
+        Handler execute;
+        uint16_t operand;
+        uint8_t opcode;
+        uint8_t length;
+        uint8_t cycles;
+        bool page_penalty;
+        bool last;
+        bool idle_loop;
+    };
+
+    friend class Jit;
+    std::unique_ptr<Jit> jit;
+    Tracer* tracer = nullptr;
+    std::vector<State>* nmi_log = nullptr;
+    Sampler* sampler = nullptr;
+    bool idle_skip = true;
+
+    void trace_instruction();
+
+#ifdef EMUNES_PROFILE
+    CpuProfile profile;
+    void profile_instruction(uint8_t opcode, uint8_t cycles);
+#else
+    void profile_instruction(uint8_t, uint8_t) {}
+#endif
+
+#ifdef EMUNES_CYCLE_CPU
+    // Cycle-stepped core: tcycle is the cycle within the current instruction
+    // (0 fetches the next opcode), the rest are its internal latches.
+    uint8_t opcode = 0x00;
+    uint8_t tcycle = 0;
+    uint16_t address = 0x0000;
+    uint16_t pointer = 0x0000;
+    uint8_t data = 0x00;
+    bool in_interrupt = false;
+    bool interrupt_ready = false;
+    bool branch_poll = false;
+
+    bool cycle_memory(const Instruction& instruction);
+    bool cycle_access(const Instruction& instruction, uint8_t access_cycle);
+    bool cycle_branch(const Instruction& instruction, bool& poll);
+    bool cycle_special(const Instruction& instruction);
+#else
+    bool nmi_defer_one_instruction = false;
+
+    // Straight-line runs of PRG ROM code decoded once and replayed by run()
+    // without going through the bus for opcode and operand bytes. Blocks are
+    // keyed by ROM offset, so a bank switch never makes them stale; run()
+    // only leaves the current block when the mapping changes under it.
+    static constexpr uint8_t max_block_length = 32;
+    const Cartridge* block_cartridge = nullptr;
+    std::vector<int32_t> block_lookup;
+    std::vector<DecodedInstruction> block_records;
+
+    const DecodedInstruction* find_block(uint16_t address);
+    int32_t decode_block(uint16_t address, size_t offset);
+    static bool is_idle_loop(const DecodedInstruction* first, const DecodedInstruction* last);
+    int64_t skip_idle_loop(int64_t iteration_cycles, int64_t budget);
+#endif
     
+    static constexpr std::array<Instruction, 256> make_instruction_table();
+    static constexpr bool is_zero_page(Mode mode) {
+        return mode == Mode::ZP0 || mode == Mode::ZPX || mode == Mode::ZPY;
+    }
+
+    template <void (CPU::*Operation)(uint8_t), Mode M>
+    static uint8_t read_op(CPU& cpu, uint16_t operand);
+    template <uint8_t (CPU::*Operation)(uint8_t), Mode M>
+    static uint8_t modify_op(CPU& cpu, uint16_t operand);
+    template <uint8_t CPU::*Register, Mode M>
+    static uint8_t store_op(CPU& cpu, uint16_t operand);
+    template <void (CPU::*Operation)(uint16_t), Mode M>
+    static uint8_t jump_op(CPU& cpu, uint16_t operand);
+    template <void (CPU::*Operation)()>
+    static uint8_t implied_op(CPU& cpu, uint16_t operand);
+    template <uint8_t Flag, bool Value>
+    static uint8_t branch_op(CPU& cpu, uint16_t operand);
+    static uint8_t illegal_op(CPU& cpu, uint16_t operand);
+
+    template <void (CPU::*Operation)(uint8_t)>
+    static uint8_t read_value(CPU& cpu, uint8_t value);
+    template <uint8_t (CPU::*Operation)(uint8_t)>
+    static uint8_t modify_value(CPU& cpu, uint8_t value);
+    template <uint8_t CPU::*Register>
+    static uint8_t register_value(CPU& cpu, uint8_t value);
+    template <void (CPU::*Operation)()>
+    static uint8_t implied_value(CPU& cpu, uint8_t value);
+    template <uint8_t Flag, bool Value>
+    static uint8_t branch_value(CPU& cpu, uint8_t value);
+    static uint8_t no_value(CPU& cpu, uint8_t value);
+
+    template <Mode M>
+    uint16_t effective_address(uint16_t operand, bool& page_crossed);
+    uint16_t fetch_operand(Mode mode);
+    uint8_t execute(uint8_t opcode);
+    uint8_t service_interrupts();
+
     bool Getflag(uint8_t flag);
     void Setflag(uint8_t flag, bool value);
+    void set_nz(uint8_t value) { nz = static_cast<uint16_t>((value << 8) | value); }
+    uint8_t pack_status() const;
+    void unpack_status(uint8_t value);
     void ADC(uint8_t operand);
     void AND(uint8_t operand);
-    void ASL_accumulator();
-    void ASL(uint16_t address);
-    void BCC(uint8_t offset);
-    void BCS(uint8_t offset);
-    void BEQ(uint8_t offset);
-    void BIT(uint16_t address);
-    void BMI(uint8_t offset);
-    void BNE(uint8_t offset);
-    void BPL(uint8_t offset);
+    uint8_t ASL(uint8_t value);
+    void BIT(uint8_t operand);
     void BRK();
-    void BVC(uint8_t offset);
-    void BVS(uint8_t offset);
     void CLC();
     void CLD();
     void CLI();
@@ -58,39 +244,33 @@ private:
     void CMP(uint8_t operand);
     void CPX(uint8_t operand);
     void CPY(uint8_t operand);
-    void DEC(uint16_t address);
+    uint8_t DEC(uint8_t value);
     void DEX();
     void DEY();
     void EOR(uint8_t operand);
-    void INC(uint16_t address);
+    uint8_t INC(uint8_t value);
     void INX();
     void INY();
     void JMP(uint16_t address);
-    void JMP_indirect(uint16_t address);
     void JSR(uint16_t address);
     void LDA(uint8_t operand);
     void LDX(uint8_t operand);
     void LDY(uint8_t operand);
-    void LSR_accumulator();
-    void LSR(uint16_t address);
+    uint8_t LSR(uint8_t value);
+    void NOP();
     void ORA(uint8_t operand);
     void PHA();
     void PHP();
     void PLA();
     void PLP();
-    void ROL_accumulator();
-    void ROL(uint16_t address);
-    void ROR_accumulator();
-    void ROR(uint16_t address);
+    uint8_t ROL(uint8_t value);
+    uint8_t ROR(uint8_t value);
     void RTI();
     void RTS();
     void SBC(uint8_t operand);
     void SEC();
     void SED();
     void SEI();
-    void STA(uint16_t address);
-    void STX(uint16_t address);
-    void STY(uint16_t address);
     void TAX();
     void TAY();
     void TSX();
@@ -102,6 +282,9 @@ private:
     uint8_t SP;        
     uint8_t A, X, Y;  
     uint8_t status;  
+    // N and Z of status are derived lazily: N is bit 15, Z is set when the
+    // low byte is zero.
+    uint16_t nz = 0x0001;
     bool running;
 
     Bus* bus = nullptr;
@@ -115,10 +298,6 @@ private:
     uint8_t stack_pop();
     uint16_t stack_pop16(); 
     uint16_t read16(uint16_t address);
-    
-    uint16_t addr_abs_x(int& cycles);
-    uint16_t addr_abs_y(int& cycles);
-    uint16_t addr_ind_y(int& cycles);
     uint16_t read16_zeropage(uint16_t address);
 };
 
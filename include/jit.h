@@ -0,0 +1,50 @@
+#ifndef JIT_H
+#define JIT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+#include <cpu.h>
+
+#if defined(__x86_64__) && !defined(_WIN32)
+#define EMUNES_JIT_SUPPORTED 1
+#endif
+
+// Translates hot pre-decoded PRG ROM blocks of CPU::run into x86-64 code.
+// Register, flag and RAM instructions are emitted inline, everything else
+// (including any access to $2000-$FFFF) calls the interpreter handler, and
+// the bus is ticked after every instruction exactly like the interpreter does.
+class Jit {
+public:
+    using BlockCode = void (*)(CPU* cpu, Jit* jit);
+
+    explicit Jit(CPU& cpu);
+    ~Jit();
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    bool is_available() const { return code_buffer != nullptr; }
+    BlockCode lookup(const CPU::DecodedInstruction* block);
+    int64_t run(BlockCode code, int64_t elapsed, int64_t cycles);
+    void flush();
+
+private:
+    static constexpr uint32_t hot_threshold = 8;
+    static constexpr size_t code_buffer_size = 8 << 20;
+
+    CPU& cpu;
+    uint8_t* code_buffer = nullptr;
+    size_t code_used = 0;
+    std::vector<uint32_t> heat;
+    std::vector<BlockCode> blocks;
+
+    int64_t elapsed = 0;
+    int64_t budget = 0;
+    uint32_t generation = 0;
+
+    BlockCode compile(const CPU::DecodedInstruction* block);
+    static uint8_t next_instruction(Jit* jit, uint32_t cycles);
+    static void last_instruction(Jit* jit, uint32_t cycles);
+};
+
+#endif //JIT_H
@@ -0,0 +1,168 @@
+#ifndef MAPPER_H
+#define MAPPER_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <cartridge.h>
+
+// Bank switching of one iNES mapper. The CPU sees $8000-$FFFF through four
+// 8KB PRG slots and the PPU sees $0000-$1FFF through eight 1KB CHR slots;
+// update_banks() recomputes them, and mappers only call it from register
+// writes, so reads are a table lookup.
+class Mapper {
+public:
+    explicit Mapper(Cartridge& cartridge) : cart(cartridge) {}
+    virtual ~Mapper() = default;
+    Mapper(const Mapper&) = delete;
+    Mapper& operator=(const Mapper&) = delete;
+
+    // nullptr for unsupported mappers.
+    static std::unique_ptr<Mapper> create(uint8_t id, Cartridge& cartridge);
+
+    size_t prg_offset(uint16_t address) const {
+        return prg_slots[(address >> 13) & 0x03] + (address & 0x1FFF);
+    }
+    uint8_t* chr_slot(uint16_t address) const { return chr_slots[(address >> 10) & 0x07]; }
+    // Cartridge::decode_chr_row() of the pattern row at `address`; which
+    // plane the address points at does not matter.
+    uint16_t chr_row(uint16_t address, bool flip) const {
+        return chr_row_slots[(address >> 10) & 0x07][(address & 0x03F0) | ((address & 0x07) << 1) | flip];
+    }
+    // Mappers that count A12 edges see every pattern table access;
+    // watches_a12 is the same answer for code specialised on the mapper type.
+    static constexpr bool watches_a12 = false;
+    bool watches_ppu_address() const { return ppu_address_watch; }
+
+    // Register write to $8000-$FFFF.
+    virtual bool cpu_write(uint16_t /*address*/, uint8_t /*data*/) { return false; }
+    virtual void ppu_address(uint16_t /*address*/) {}
+    // A12 rising edges until the mapper raises IRQ, or -1 if it will not
+    // before the CPU writes one of its registers.
+    virtual int a12_rises_until_irq() const { return -1; }
+
+    // The IRQ output; the callback only hears about transitions.
+    using IrqCallback = void (*)(void* context, bool asserted);
+    void connect_irq(IrqCallback callback, void* context) {
+        irq_callback = callback;
+        irq_context = context;
+    }
+    bool irq_asserted() const { return irq_output; }
+
+protected:
+    Cartridge& cart;
+    bool ppu_address_watch = false;
+
+    virtual void update_banks() = 0;
+
+    // Maps `size` bytes at `address` to bank `bank` of that size; offsets
+    // wrap around the end of the ROM like the old per-access modulo did.
+    void map_prg(uint16_t address, size_t bank, size_t size);
+    void map_chr(uint16_t address, size_t bank, size_t size);
+    size_t prg_bank_count(size_t size) const;
+    size_t chr_bank_count(size_t size) const;
+    bool has_one_prg_bank() const { return cart.prg_banks == 1; }
+    void set_mirroring(Cartridge::MIRROR mode) { cart.set_mirroring(mode); }
+    Cartridge::MIRROR get_mirroring() const { return cart.get_mirroring(); }
+    void prg_remapped() { cart.prg_bank_generation++; }
+    void set_irq(bool asserted) {
+        if (asserted != irq_output) {
+            irq_output = asserted;
+            if (irq_callback) {
+                irq_callback(irq_context, asserted);
+            }
+        }
+    }
+
+private:
+    std::array<size_t, 4> prg_slots{};
+    std::array<uint8_t*, 8> chr_slots{};
+    std::array<const uint16_t*, 8> chr_row_slots{};
+    bool irq_output = false;
+    IrqCallback irq_callback = nullptr;
+    void* irq_context = nullptr;
+};
+
+class NromMapper final : public Mapper {
+public:
+    using Mapper::Mapper;
+
+protected:
+    void update_banks() override;
+};
+
+class Mmc1Mapper final : public Mapper {
+public:
+    using Mapper::Mapper;
+    bool cpu_write(uint16_t address, uint8_t data) override;
+
+protected:
+    void update_banks() override;
+
+private:
+    uint8_t shift = 0x10;
+    uint8_t control = 0x0C;
+    uint8_t chr_bank0 = 0x00;
+    uint8_t chr_bank1 = 0x00;
+    uint8_t prg_bank = 0x00;
+
+    void update_mirroring();
+};
+
+class UxromMapper final : public Mapper {
+public:
+    using Mapper::Mapper;
+    bool cpu_write(uint16_t address, uint8_t data) override;
+
+protected:
+    void update_banks() override;
+
+private:
+    uint8_t prg_bank = 0x00;
+};
+
+class CnromMapper final : public Mapper {
+public:
+    using Mapper::Mapper;
+    bool cpu_write(uint16_t address, uint8_t data) override;
+
+protected:
+    void update_banks() override;
+
+private:
+    uint8_t chr_bank = 0x00;
+};
+
+class Mmc3Mapper final : public Mapper {
+public:
+    static constexpr bool watches_a12 = true;
+
+    explicit Mmc3Mapper(Cartridge& cartridge);
+    bool cpu_write(uint16_t address, uint8_t data) override;
+    // Inline so that the specialised PPU only pays for a compare on fetches
+    // that leave A12 where it was.
+    void ppu_address(uint16_t address) override {
+        const bool a12 = (address & 0x1000) != 0;
+        if (a12 != prev_a12) {
+            a12_changed(a12);
+        }
+    }
+    int a12_rises_until_irq() const override;
+
+protected:
+    void update_banks() override;
+
+private:
+    uint8_t bank_select = 0x00;
+    uint8_t bank_regs[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+    uint8_t irq_latch = 0x00;
+    uint8_t irq_counter = 0x00;
+    bool irq_reload = false;
+    bool irq_enabled = false;
+    bool prev_a12 = false;
+
+    void a12_changed(bool a12);
+};
+
+#endif //MAPPER_H
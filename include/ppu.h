@@ -2,8 +2,12 @@
 #define PPU_H
 #include <iostream>
 #include <cstdint>
+#include <vector>
+#include <compose.h>
 
 class Bus;
+class Cartridge;
+class Mapper;
 
 class PPU {
 public:
@@ -12,17 +16,49 @@ public:
     ~PPU();
     
     void connect_bus(Bus* b) { bus = b; }
+    void connect_cartridge(Cartridge* cartridge);
     void clock();
+    // Dots 1-256 of a visible line in one go, bit-identical to 256 clock()
+    // calls; false, with nothing done, anywhere else or while an NMI is on
+    // its way. The caller must not need the PPU mid-line: register accesses
+    // and mapper writes have to land on either side of it.
+    bool clock_line();
+    void set_scanline_renderer(bool enabled) { scanline_renderer = enabled; }
+    // The kernel clock_line() composes pixels with, best_compose_kernel() by
+    // default; false, keeping the current one, if `kernel` is unsupported.
+    bool set_compose_kernel(ComposeKernel kernel);
+
+    // Pattern table fetches of clock() are specialised on the cartridge's
+    // mapper class; disabled, they go through Bus and Cartridge like $2007.
+    void set_mapper_specialisation(bool enabled);
 
     uint8_t cpu_read(uint16_t address);
     void cpu_write(uint16_t address, uint8_t data);
     
     uint32_t* get_screen();
     bool frame_complete = false;
+    // Debug copy of every frame, appended as it completes, so that a caller
+    // that only looks after the PPU has drawn into the next one still sees it.
+    void set_frame_log(std::vector<uint32_t>* log) { frame_log = log; }
     
     int scanline = 0;
     int cycle = 0;
     
+    // Dots until PPUSTATUS bit 7 can next change (VBlank set or the pre-render
+    // line), or 0 while the flag is set or an NMI is already on its way to the CPU.
+    int dots_until_vblank_event() const;
+    // Dots until the VBlank dot, the only one that can start an NMI by itself,
+    // or 0 while an NMI is already on its way to the CPU.
+    int dots_until_nmi() const;
+    // Lower bound on the dots until A12 of a pattern fetch can rise for the
+    // `rises`-th time, -1 if PPUCTRL makes that unpredictable (8x16 sprites
+    // fetch from both tables) or INT_MAX if it cannot rise at all.
+    int dots_until_a12_rise(int rises) const;
+    // Whether sprite evaluation may read OAM within the next `dots` dots.
+    bool reads_oam_within(int dots) const;
+    // 256 OAMDATA writes at once, starting at OAMADDR and wrapping around.
+    void write_oam_page(const uint8_t* data);
+
     void log_status();
     void reset();
     uint8_t oam[256];
@@ -31,8 +67,12 @@ private:
     
     uint8_t oam_addr = 0x00;
     
-    uint8_t vram[4096];
+    // CIRAM, and where each 1KB nametable at $2000-$2FFF is, as mapped by
+    // the cartridge.
+    uint8_t vram[2048];
+    uint8_t* nametable_pages[4];
     uint8_t palette_ram[32];
+    uint32_t palette_colors[32];
     
     uint8_t reg_ctrl = 0x00;
     uint8_t reg_mask = 0x00;
@@ -54,34 +94,37 @@ private:
     uint8_t sprite_count = 0;
     uint8_t sprite_count_next = 0;
         
-    uint8_t sprite_shifter_pattern_lo[8];
-    uint8_t sprite_shifter_pattern_hi[8];
-    uint8_t sprite_shifter_pattern_lo_next[8];
-    uint8_t sprite_shifter_pattern_hi_next[8];
+    // Pattern rows are kept decoded, two bits a pixel with the next one on top.
+    uint16_t sprite_shifter_pattern[8];
+    uint16_t sprite_shifter_pattern_next[8];
     
     bool sprite_zero_hit_possible = false;
     bool sprite_zero_hit_possible_next = false;
     bool sprite_zero_being_rendered = false;
     
-    uint16_t bg_shifter_pattern_lo = 0x0000;
-    uint16_t bg_shifter_pattern_hi = 0x0000;
-    uint16_t bg_shifter_attrib_lo = 0x0000;
-    uint16_t bg_shifter_attrib_hi = 0x0000;
+    uint32_t bg_shifter_pattern = 0x00000000;
+    uint32_t bg_shifter_attrib = 0x00000000;
     
     uint8_t bg_next_tile_id = 0x00;
     uint8_t bg_next_tile_attrib = 0x00;
-    uint8_t bg_next_tile_lsb = 0x00;
-    uint8_t bg_next_tile_msb = 0x00;
+    uint16_t bg_next_tile_row = 0x0000;
     
 
     uint16_t vram_addr = 0x0000;
     uint8_t ppu_data_buffer = 0x00;
     
     uint32_t screen[256 * 240];
+    std::vector<uint32_t>* frame_log = nullptr;
     
     
     uint8_t ppu_read(uint16_t address, bool read_only = false);
+    uint8_t read_vram(uint16_t address);
     void ppu_write(uint16_t address, uint8_t data);
+    template <class MapperType> uint8_t fetch(uint16_t address);
+    template <class MapperType> uint16_t fetch_row(uint16_t address, bool flip);
+    template <class MapperType> void clock_dot();
+    template <class MapperType> void render_line();
+    void evaluate_next_sprites();
     void increment_scroll_x();
     void increment_scroll_y();
     void transfer_address_x();
@@ -89,8 +132,17 @@ private:
     void load_background_shifters();
     void update_shifters();
     void update_nmi_state(bool immediate_enable = false);
+    void update_palette_colors();
     
     Bus* bus = nullptr;
+    Cartridge* cart = nullptr;
+    Mapper* mapper = nullptr;
+    bool mapper_specialisation = true;
+    bool scanline_renderer = true;
+    ComposeLine compose_line = compose_kernel(best_compose_kernel());
+    // Mapper number clock() dispatches on, -1 for the generic path.
+    int mapper_dispatch = -1;
+    void update_mapper_dispatch();
 
     bool odd_frame = false;
     bool nmi_output = false;
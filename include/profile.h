@@ -0,0 +1,29 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+#include <array>
+#include <cstdint>
+#include <string>
+
+// Execution counters of one opcode. Page crosses are the penalty cycles of
+// indexed reads and taken branches; interrupts are not counted.
+struct OpcodeProfile {
+    uint64_t executions = 0;
+    uint64_t cycles = 0;
+    uint64_t page_crosses = 0;
+    uint64_t branches_taken = 0;
+    uint64_t branches_not_taken = 0;
+};
+
+// Filled by the CPU when built with EMUNES_PROFILE. Instructions run by the
+// JIT or fast-forwarded by idle loop skipping are not counted, so the JIT is
+// not available in profiling builds.
+struct CpuProfile {
+    std::array<OpcodeProfile, 256> opcodes{};
+
+    void clear() { opcodes = {}; }
+    bool write_csv(const std::string& path) const;
+    // Per-opcode entries plus the totals of every addressing mode.
+    bool write_json(const std::string& path) const;
+};
+
+#endif //PROFILE_H
@@ -0,0 +1,64 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class Bus;
+
+// Attributes CPU time to (PRG bank, PC) under a shadow call stack rebuilt from
+// JSR/RTS, BRK, NMI/IRQ entry and RTI, and writes it as folded stacks for
+// flamegraph tools. Locations are mapped through the cartridge's current bank
+// registers, so the same PC in two banks stays two routines. One sample is
+// taken every `period` CPU cycles; with a period of 1 the counts are cycles.
+class Sampler {
+public:
+    enum class Entry : uint8_t {
+        CALL, NMI, IRQ, BRK,
+    };
+
+    explicit Sampler(Bus& bus, uint32_t period = 1);
+
+    // Called before every instruction.
+    void sample(uint16_t pc);
+    // stack_pointer is SP before the return address was pushed; the matching
+    // RTS/RTI brings SP back to it, which also drops frames left behind by
+    // stack tricks that never return normally.
+    void enter(Entry entry, uint16_t target, uint8_t stack_pointer);
+    void leave(uint8_t stack_pointer);
+
+    bool write_folded(const std::string& path) const;
+
+private:
+    static constexpr size_t max_depth = 256;
+
+    struct Node {
+        uint32_t parent;
+        uint32_t frame;
+    };
+    struct Frame {
+        uint32_t node;
+        uint8_t stack_pointer;
+    };
+
+    Bus& bus;
+    int64_t period;
+    int64_t countdown;
+    uint64_t last_timestamp = 0;
+    bool has_previous = false;
+    uint64_t previous = 0;
+
+    // Call tree of every stack seen so far; node 0 is the root.
+    std::vector<Node> nodes;
+    std::unordered_map<uint64_t, uint32_t> children;
+    std::vector<Frame> stack;
+    // Samples keyed by node << 32 | location of the sampled PC.
+    std::unordered_map<uint64_t, uint64_t> counts;
+
+    uint32_t locate(uint16_t address) const;
+    uint32_t current_node() const { return stack.empty() ? 0 : stack.back().node; }
+    static std::string describe(uint32_t frame);
+};
+
+#endif //SAMPLER_H
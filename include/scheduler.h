@@ -0,0 +1,40 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+#include <array>
+#include <cstdint>
+
+// Master clock timestamps at which the CPU has to stop and let a component
+// catch up, because from then on the component may change something the CPU
+// can see (an interrupt line, a register). Components run lazily in between
+// and reschedule themselves every time they are caught up.
+class Scheduler {
+public:
+    enum Event {
+        PPU_VBLANK,
+        MAPPER_IRQ,
+        APU_FRAME,
+        APU_DMC,
+        EVENT_COUNT,
+    };
+    static constexpr uint64_t never = UINT64_MAX;
+
+    Scheduler() { times.fill(never); }
+
+    void schedule(Event event, uint64_t timestamp) {
+        times[event] = timestamp;
+        next = never;
+        for (uint64_t time : times) {
+            next = time < next ? time : next;
+        }
+    }
+    void cancel(Event event) { schedule(event, never); }
+
+    bool is_due(Event event, uint64_t timestamp) const { return times[event] <= timestamp; }
+    uint64_t next_event() const { return next; }
+
+private:
+    std::array<uint64_t, EVENT_COUNT> times;
+    uint64_t next = never;
+};
+
+#endif //SCHEDULER_H
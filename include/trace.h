@@ -0,0 +1,76 @@
+#ifndef TRACE_H
+#define TRACE_H
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+// One executed instruction, captured just before it runs. address, pointer and
+// value are the operand annotations of nestest.log: the effective address, the
+// (zp),Y base address and the byte at the effective address (I/O reads as $FF).
+struct TraceRecord {
+    uint64_t cycle;
+    uint16_t pc;
+    uint8_t bytes[3];
+    uint8_t a, x, y, p, sp;
+    int16_t scanline;
+    uint16_t dot;
+    uint16_t address;
+    uint16_t pointer;
+    uint8_t value;
+    uint8_t reserved[5];
+};
+static_assert(sizeof(TraceRecord) == 32, "trace records are written to disk as is");
+
+struct TraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+};
+
+// Appends TraceRecords to a preallocated ring buffer. With an output file the
+// buffer is written out every time it fills up, so the trace has no length
+// limit; without one only the last `capacity` instructions are kept and can
+// be written with save().
+class Tracer {
+public:
+    static constexpr char magic[8] = {'E', 'M', 'U', 'T', 'R', 'A', 'C', 'E'};
+    static constexpr uint32_t version = 1;
+
+    explicit Tracer(size_t capacity = 1 << 16);
+    ~Tracer();
+    Tracer(const Tracer&) = delete;
+    Tracer& operator=(const Tracer&) = delete;
+
+    bool open(const std::string& path);
+    bool save(const std::string& path) const;
+    void flush();
+
+    void record(const TraceRecord& record) {
+        buffer[head] = record;
+        count++;
+        if (++head == buffer.size()) {
+            wrap();
+        }
+    }
+    uint64_t get_count() const { return count; }
+    // Records still held in memory, oldest first.
+    std::vector<TraceRecord> records() const;
+
+    static bool read_header(std::FILE* file);
+    // One line in the nestest.log layout, without the line break.
+    static std::string to_nestest_line(const TraceRecord& record);
+
+private:
+    std::vector<TraceRecord> buffer;
+    size_t head = 0;
+    bool wrapped = false;
+    uint64_t count = 0;
+    std::FILE* file = nullptr;
+
+    void wrap();
+    static bool write_header(std::FILE* file);
+};
+
+#endif //TRACE_H
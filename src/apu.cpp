@@ -5,6 +5,8 @@
 #include <algorithm>
 #include <cmath>
 #include <cstdint>
+#include <iterator>
+#include <tuple>
 
 static const uint8_t length_table[] = {
     10, 254, 20, 2, 40, 4, 80, 6, 160, 8, 60, 10, 14, 12, 26, 14,
@@ -50,7 +52,7 @@ void APU::reset() {
     frame_interrupt = false;
     even_cycle = false;
 
-    global_time = 0.0;
+    sample_clock = 0;
     sample_ready = false;
     output_sample = 0.0f;
 
@@ -72,8 +74,16 @@ void APU::reset() {
     dmc.current_address = 0xC000;
     dmc.sample_length = 1;
 
+    update_irq_line();
+}
+
+void APU::update_irq_line() {
+    const bool asserted = frame_interrupt || dmc.irq_flag;
+    if (irq_log) {
+        irq_log->push_back(asserted);
+    }
     if (bus) {
-        bus->set_irq_line(false);
+        bus->set_irq_line(asserted);
     }
 }
 
@@ -170,9 +180,7 @@ void APU::cpu_write(uint16_t address, uint8_t data) {
         dmc.timer_period = dmc_rate_table[dmc.rate_index];
         if (!dmc.irq_enabled) {
             dmc.irq_flag = false;
-            if (bus) {
-                bus->set_irq_line(frame_interrupt || dmc.irq_flag);
-            }
+            update_irq_line();
         }
         break;
     case 0x4011:
@@ -198,9 +206,7 @@ void APU::cpu_write(uint16_t address, uint8_t data) {
 
         dmc.irq_flag = false;
         dmc.enabled = dmc_enable;
-        if (bus) {
-            bus->set_irq_line(frame_interrupt || dmc.irq_flag);
-        }
+        update_irq_line();
         if (!dmc.enabled) {
             dmc.bytes_remaining = 0;
         } else if (dmc.bytes_remaining == 0) {
@@ -213,9 +219,7 @@ void APU::cpu_write(uint16_t address, uint8_t data) {
         irq_inhibit = (data & 0x40) != 0;
         if (irq_inhibit) {
             frame_interrupt = false;
-            if (bus) {
-                bus->set_irq_line(frame_interrupt || dmc.irq_flag);
-            }
+            update_irq_line();
         }
         frame_clock_counter = 0;
         if (frame_counter_mode) {
@@ -239,9 +243,7 @@ uint8_t APU::cpu_read(uint16_t address) {
         if (frame_interrupt) data |= 0x40;
         if (dmc.irq_flag) data |= 0x80;
         frame_interrupt = false;
-        if (bus) {
-            bus->set_irq_line(frame_interrupt || dmc.irq_flag);
-        }
+        update_irq_line();
     }
     return data;
 }
@@ -406,16 +408,17 @@ void APU::fill_dmc_sample_buffer() {
             restart_dmc_sample();
         } else if (dmc.irq_enabled) {
             dmc.irq_flag = true;
-            if (bus) {
-                bus->set_irq_line(frame_interrupt || dmc.irq_flag);
-            }
+            update_irq_line();
         }
     }
 }
 
 void APU::clock_dmc() {
     fill_dmc_sample_buffer();
+    clock_dmc_output();
+}
 
+void APU::clock_dmc_output() {
     if (dmc.timer == 0) {
         dmc.timer = dmc.timer_period;
 
@@ -488,9 +491,7 @@ void APU::clock() {
         } else if (frame_clock_counter == 29829 || frame_clock_counter == 29830) {
             if (!irq_inhibit) {
                 frame_interrupt = true;
-                if (bus) {
-                    bus->set_irq_line(frame_interrupt || dmc.irq_flag);
-                }
+                update_irq_line();
             }
         } else if (frame_clock_counter == 29831) {
             clock_quarter_frame();
@@ -518,12 +519,170 @@ void APU::clock() {
     clock_triangle();
     clock_dmc();
 
-    global_time += time_per_clock;
-    while (global_time >= time_per_sample) {
-        global_time -= time_per_sample;
+    sample_clock += sample_rate;
+    if (sample_clock >= cpu_clock_rate) {
+        sample_clock -= cpu_clock_rate;
         sample_ready = true;
         output_sample = mix_sample();
+        if (sample_log) {
+            sample_log->push_back(output_sample);
+        }
+    }
+}
+
+namespace {
+
+// Clocks a timer that counts down to 0 and then reloads `period`; returns
+// how many times it reloaded.
+uint32_t advance_timer(uint16_t& timer, uint16_t period, uint32_t clocks) {
+    if (clocks <= timer) {
+        timer = static_cast<uint16_t>(timer - clocks);
+        return 0;
+    }
+    clocks -= timer + 1u;
+    const uint32_t length = period + 1u;
+    timer = static_cast<uint16_t>(period - clocks % length);
+    return 1 + clocks / length;
+}
+
+} // namespace
+
+void APU::run(uint32_t cycles) {
+    while (cycles > 0) {
+        const uint32_t until_sample = (cpu_clock_rate - sample_clock + sample_rate - 1) / sample_rate;
+        const uint32_t plain = std::min(cycles, std::min(cycles_until_frame_step(), until_sample) - 1);
+        if (plain == 0) {
+            clock();
+            cycles--;
+        } else {
+            run_channels(plain);
+            cycles -= plain;
+        }
+    }
+}
+
+// Cycles until the frame counter reaches its next step, counting the next cycle as 1.
+uint32_t APU::cycles_until_frame_step() const {
+    static const uint32_t four_step[] = {7457, 14913, 22371, 29829, 29830, 29831};
+    static const uint32_t five_step[] = {7457, 14913, 22371, 37281, 37282};
+    const uint32_t* begin = frame_counter_mode ? std::begin(five_step) : std::begin(four_step);
+    const uint32_t* end = frame_counter_mode ? std::end(five_step) : std::end(four_step);
+    for (const uint32_t* step = begin; step != end; ++step) {
+        if (*step > frame_clock_counter) {
+            return static_cast<uint32_t>(*step - frame_clock_counter);
+        }
+    }
+    return 1;
+}
+
+// `cycles` cycles with no frame counter step and no output sample in them.
+void APU::run_channels(uint32_t cycles) {
+    frame_clock_counter += cycles;
+    sample_clock += cycles * sample_rate;
+
+    const uint32_t half_clocks = (cycles + (even_cycle ? 0 : 1)) / 2;
+    even_cycle = even_cycle != ((cycles & 1) != 0);
+    pulse1.sequence_pos = (pulse1.sequence_pos + advance_timer(pulse1.timer, pulse1.timer_period, half_clocks)) & 0x07;
+    pulse2.sequence_pos = (pulse2.sequence_pos + advance_timer(pulse2.timer, pulse2.timer_period, half_clocks)) & 0x07;
+    run_noise(half_clocks);
+
+    const uint32_t steps = advance_timer(triangle.timer, triangle.timer_period, cycles);
+    if (triangle.length_value > 0 && triangle.linear_counter > 0 && triangle.timer_period > 1) {
+        triangle.sequence_pos = (triangle.sequence_pos + steps) & 0x1F;
+    }
+
+    run_dmc(cycles);
+}
+
+void APU::run_noise(uint32_t clocks) {
+    while (clocks > noise.timer) {
+        clocks -= noise.timer + 1u;
+        noise.timer = 0;
+        clock_noise();
+    }
+    noise.timer = static_cast<uint16_t>(noise.timer - clocks);
+}
+
+// The sample buffer is only refilled after an output clock emptied it, so
+// one fill attempt per output clock matches one per cycle.
+void APU::run_dmc(uint32_t cycles) {
+    for (;;) {
+        fill_dmc_sample_buffer();
+        if (cycles <= dmc.timer) {
+            dmc.timer = static_cast<uint16_t>(dmc.timer - cycles);
+            return;
+        }
+        cycles -= dmc.timer + 1u;
+        dmc.timer = 0;
+        clock_dmc_output();
+        if (cycles == 0) {
+            return;
+        }
+    }
+}
+
+uint32_t APU::cycles_until_frame_irq() const {
+    if (frame_counter_mode || irq_inhibit || frame_clock_counter > 29830) {
+        return no_irq;
+    }
+    if (frame_clock_counter < 29830) {
+        return static_cast<uint32_t>(29829 - frame_clock_counter) + (frame_clock_counter == 29829 ? 1 : 0);
     }
+    return 1 + 29829;
+}
+
+// The IRQ comes with the fetch of the last byte. Before it, every other
+// byte but the next has to go through the 8-bit shift register.
+uint32_t APU::cycles_until_dmc_irq() const {
+    if (!dmc.enabled || !dmc.irq_enabled || dmc.loop || dmc.bytes_remaining == 0) {
+        return no_irq;
+    }
+    if (dmc.bytes_remaining <= 2) {
+        return 1;
+    }
+    return static_cast<uint32_t>(dmc.bytes_remaining - 2) * 8 * (dmc.timer_period + 1u);
+}
+
+const char* APU::state_difference(const APU& other) const {
+    const auto pulse = [](const PulseChannel& p) {
+        return std::tie(p.enabled, p.timer, p.timer_period, p.sequence_pos, p.duty_mode, p.envelope_start,
+                        p.envelope_loop, p.constant_volume, p.volume_envelope, p.envelope_period,
+                        p.envelope_counter, p.constant_volume_val, p.length_value, p.length_halt,
+                        p.sweep_enable, p.sweep_negate, p.sweep_period, p.sweep_shift, p.sweep_counter,
+                        p.sweep_reload, p.sweep_target_period, p.sweep_mute);
+    };
+    const auto triangle_state = [](const TriangleChannel& t) {
+        return std::tie(t.enabled, t.timer, t.timer_period, t.sequence_pos, t.length_value, t.length_halt,
+                        t.linear_counter_reload, t.linear_counter, t.linear_reload_flag);
+    };
+    const auto noise_state = [](const NoiseChannel& n) {
+        return std::tie(n.enabled, n.timer, n.timer_period, n.shift_register, n.mode, n.envelope_start,
+                        n.envelope_loop, n.constant_volume, n.volume_envelope, n.envelope_period,
+                        n.envelope_counter, n.constant_volume_val, n.length_value, n.length_halt);
+    };
+    const auto dmc_state = [](const DMCChannel& d) {
+        return std::tie(d.enabled, d.irq_enabled, d.irq_flag, d.loop, d.rate_index, d.timer, d.timer_period,
+                        d.output_level, d.sample_buffer, d.sample_buffer_empty, d.shift_register,
+                        d.bits_remaining, d.silence, d.sample_address, d.current_address, d.sample_length,
+                        d.bytes_remaining);
+    };
+    const auto frame_counter = [](const APU& apu) {
+        return std::tie(apu.frame_clock_counter, apu.frame_counter_mode, apu.irq_inhibit, apu.frame_interrupt,
+                        apu.even_cycle);
+    };
+    const auto output = [](const APU& apu) {
+        return std::tie(apu.sample_clock, apu.sample_ready, apu.output_sample, apu.hp_90_state, apu.hp_440_state,
+                        apu.lp_14000_state, apu.hp_90_prev_input, apu.hp_440_prev_input);
+    };
+
+    if (pulse(pulse1) != pulse(other.pulse1)) return "pulse 1";
+    if (pulse(pulse2) != pulse(other.pulse2)) return "pulse 2";
+    if (triangle_state(triangle) != triangle_state(other.triangle)) return "triangle";
+    if (noise_state(noise) != noise_state(other.noise)) return "noise";
+    if (dmc_state(dmc) != dmc_state(other.dmc)) return "DMC";
+    if (frame_counter(*this) != frame_counter(other)) return "frame counter";
+    if (output(*this) != output(other)) return "output";
+    return nullptr;
 }
 
 float APU::get_pulse_output(const PulseChannel& p, bool ones_complement) const {
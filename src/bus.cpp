@@ -1,90 +1,342 @@
 #include <bus.h>
+#include <mapper.h>
+#include <climits>
 
+// Dot-stepped path: nothing is behind, so events are not rescheduled here.
+// Their timestamps are absolute and an outdated one can only fall due early.
 void Bus::clock() {
-    ppu.clock();
-    set_cartridge_irq_line(cart && cart->irq_asserted());
+    advance_ppu(system_clock_counter + 1);
 
-    if ((system_clock_counter % 3) == 0) {
+    if (cpu_phase == 0) {
         if (dma_transfer) {
-            if (dma_dummy) {
-                if ((system_clock_counter % 2) == 1) {
-                    dma_dummy = false;
-                }
-            } else {
-                if ((system_clock_counter % 2) == 0) {
-                    dma_data = cpu_read(((uint16_t)dma_page << 8) | dma_addr);
-                } else {
-                    ppu.cpu_write(0x0004, dma_data);
-                    dma_addr++;
-                    if (dma_addr == 0x00) {
-                        dma_transfer = false;
-                        dma_dummy = true;
-                    }
-                }
-            }
+            clock_dma();
         } else {
             cpu.clock();
         }
-
-        apu.clock();
+        advance_apu(system_clock_counter + 1);
     }
 
+    cpu_phase = cpu_phase == 2 ? 0 : cpu_phase + 1;
     system_clock_counter++;
 }
 
-void Bus::cpu_write(uint16_t address, uint8_t data) {
-    if (cart && cart->cpu_write(address, data)) {
+void Bus::run_until(uint64_t timestamp) {
+    // The PPU or APU may have been reset or the cartridge swapped since the last call.
+    schedule_ppu();
+    schedule_apu();
+
+    // Finish anything clock() left half-way so that the CPU starts on an instruction boundary.
+    while (system_clock_counter < timestamp &&
+           (cpu_phase != 0 || dma_transfer || !cpu.is_instruction_complete())) {
+        clock();
+    }
+
+    if (system_clock_counter < timestamp) {
+        cpu.run(static_cast<int64_t>((timestamp - system_clock_counter + 2) / 3));
+    }
+    sync_ppu(system_clock_counter);
+    sync_apu(system_clock_counter);
+}
+
+// A master cycle on a CPU boundary is: PPU dot, CPU (or DMA), APU, PPU dot, PPU dot.
+// CPU::run executes a whole instruction in its first CPU cycle, when the PPU
+// has run the leading dot and the APU has not clocked yet; the remaining
+// cycles only move the clock forward, except for OAM DMA.
+int64_t Bus::end_cpu_cycles(uint8_t cycles) {
+    system_clock_counter += 3;
+    int64_t elapsed = 1;
+    if (dma_transfer) {
+        elapsed += run_dma();
+    }
+
+    const uint8_t remaining = cycles - 1;
+    system_clock_counter += 3 * static_cast<uint64_t>(remaining);
+    return elapsed + remaining;
+}
+
+void Bus::run_events() {
+    const uint64_t now = system_clock_counter;
+    if (scheduler.is_due(Scheduler::PPU_VBLANK, now) || scheduler.is_due(Scheduler::MAPPER_IRQ, now)) {
+        sync_ppu(now + 1);
+    }
+    if (scheduler.is_due(Scheduler::APU_FRAME, now) || scheduler.is_due(Scheduler::APU_DMC, now)) {
+        sync_apu(now);
+    }
+}
+
+void Bus::sync_ppu(uint64_t timestamp) {
+    advance_ppu(timestamp);
+    schedule_ppu();
+}
+
+void Bus::sync_apu(uint64_t timestamp) {
+    advance_apu(timestamp);
+    schedule_apu();
+}
+
+// Catch-up stops at every register access and mapper write, so a visible
+// line it runs through from dot 1 to 256 is one nothing changed in the middle
+// of, and the PPU can draw it whole.
+void Bus::advance_ppu(uint64_t timestamp) {
+    while (ppu_timestamp < timestamp) {
+        if (ppu.cycle == 1 && timestamp - ppu_timestamp >= 256 && ppu.clock_line()) {
+            ppu_timestamp += 256;
+            continue;
+        }
+        ppu.clock();
+        ppu_timestamp++;
+    }
+}
+
+void Bus::advance_apu(uint64_t timestamp) {
+    for (size_t i = 0; i < apu_write_count; i++) {
+        run_apu(apu_writes[i].timestamp);
+        apu.cpu_write(apu_writes[i].address, apu_writes[i].data);
+    }
+    apu_write_count = 0;
+    run_apu(timestamp);
+}
+
+void Bus::run_apu(uint64_t timestamp) {
+    if (apu_timestamp < timestamp) {
+        const uint64_t cycles = (timestamp - apu_timestamp + 2) / 3;
+        apu.run(static_cast<uint32_t>(cycles));
+        apu_timestamp += 3 * cycles;
+    }
+}
+
+// An instruction at timestamp t sees the PPU after the dot at t. NMI can only
+// be raised from the VBlank dot on, so the PPU is due one dot before it (the
+// skipped odd-frame dot), or right away while an NMI is on its way. A12
+// counting mappers are due before the pattern fetch that can first bring
+// their counter to IRQ, or on every dot when the PPU cannot tell.
+void Bus::schedule_ppu() {
+    const int dots = ppu.dots_until_nmi();
+    scheduler.schedule(Scheduler::PPU_VBLANK, ppu_timestamp + (dots > 0 ? dots - 1 : 0));
+    const Mapper* mapper = cart ? cart->get_mapper() : nullptr;
+    const int rises = mapper && mapper->watches_ppu_address() ? mapper->a12_rises_until_irq() : -1;
+    const int irq_dots = rises > 0 ? ppu.dots_until_a12_rise(rises) : INT_MAX;
+    if (irq_dots < 0) {
+        scheduler.schedule(Scheduler::MAPPER_IRQ, ppu_timestamp);
+    } else if (irq_dots == INT_MAX) {
+        scheduler.cancel(Scheduler::MAPPER_IRQ);
+    } else {
+        scheduler.schedule(Scheduler::MAPPER_IRQ, ppu_timestamp + static_cast<uint64_t>(irq_dots));
     }
-    else if (address >= 0x0000 && address <= 0x1FFF) {
-        cpu_ram[address & 0x07FF] = data;
-    } else if (address >= 0x2000 && address <= 0x3FFF) {
-        ppu.cpu_write(address & 0x0007, data);
+}
+
+// An instruction at timestamp t sees the APU after the cycles before t, so
+// it is due one dot after the cycle that may raise IRQ.
+void Bus::schedule_apu() {
+    const uint32_t frame = apu.cycles_until_frame_irq();
+    const uint32_t dmc = apu.cycles_until_dmc_irq();
+    scheduler.schedule(Scheduler::APU_FRAME, frame == APU::no_irq ? Scheduler::never
+                                                                  : apu_timestamp + 3 * (frame - 1ull) + 1);
+    scheduler.schedule(Scheduler::APU_DMC, dmc == APU::no_irq ? Scheduler::never
+                                                              : apu_timestamp + 3 * (dmc - 1ull) + 1);
+}
+
+// OAM DMA stalls the CPU for one dummy cycle (two when it starts on an even
+// one) and 256 read/write pairs. From plain memory it is a single copy, as
+// long as the PPU does not read OAM before the last write would have landed.
+int64_t Bus::run_dma() {
+    const uint64_t start = system_clock_counter;
+    const int64_t stall = (start & 1) ? 513 : 514;
+    sync_ppu(start + 1);
+    const uint8_t* source = pages[dma_page].read;
+    if (dma_dummy && dma_addr == 0x00 && source && !ppu.reads_oam_within(static_cast<int>(3 * stall))) {
+        ppu.write_oam_page(source);
+        dma_transfer = false;
+        system_clock_counter += 3 * static_cast<uint64_t>(stall);
+        return stall;
     }
-    else if (address == 0x4014) {
-        dma_page = data;
-        dma_addr = 0x00;
-        dma_transfer = true;
-        dma_dummy = true;
+
+    int64_t elapsed = 0;
+    while (dma_transfer) {
+        clock_dma();
+        system_clock_counter += 3;
+        elapsed++;
+    }
+    return elapsed;
+}
+
+void Bus::clock_dma() {
+    if (dma_dummy) {
+        if ((system_clock_counter & 1) == 1) {
+            dma_dummy = false;
+        }
+    } else {
+        if ((system_clock_counter & 1) == 0) {
+            dma_data = cpu_read(((uint16_t)dma_page << 8) | dma_addr);
+        } else {
+            sync_ppu(system_clock_counter + 1);
+            ppu.cpu_write(0x0004, dma_data);
+            dma_addr++;
+            if (dma_addr == 0x00) {
+                dma_transfer = false;
+                dma_dummy = true;
+            }
+        }
+    }
+}
+
+// The access can move NMI or, through PPUCTRL and $2007, the next A12 edge,
+// so events are predicted again after it.
+uint8_t Bus::read_ppu(Bus& bus, uint16_t address) {
+    bus.advance_ppu(bus.system_clock_counter + 1);
+    const uint8_t data = bus.ppu.cpu_read(address & 0x0007);
+    bus.schedule_ppu();
+    if (bus.register_log) {
+        bus.register_log->push_back({bus.system_clock_counter, address, data});
+    }
+    return data;
+}
+
+void Bus::write_ppu(Bus& bus, uint16_t address, uint8_t data) {
+    bus.advance_ppu(bus.system_clock_counter + 1);
+    bus.ppu.cpu_write(address & 0x0007, data);
+    bus.schedule_ppu();
+}
+
+uint8_t Bus::read_io(Bus& bus, uint16_t address) {
+    uint8_t data = 0x00;
+    if (address == 0x4016) {
+        data = bus.controller[0].read();
+    }
+    else if (address == 0x4015) {
+        bus.sync_apu(bus.system_clock_counter);
+        data = bus.apu.cpu_read(address);
+    }
+    else if (address == 0x4017) {
+        data = bus.controller[1].read();
+    }
+    else if (bus.cart) {
+        bus.cart->cpu_read(address, data);
+    }
+    if (bus.register_log) {
+        bus.register_log->push_back({bus.system_clock_counter, address, data});
+    }
+    return data;
+}
+
+void Bus::write_io(Bus& bus, uint16_t address, uint8_t data) {
+    if (address == 0x4014) {
+        bus.dma_page = data;
+        bus.dma_addr = 0x00;
+        bus.dma_transfer = true;
+        bus.dma_dummy = true;
     }
     else if (address == 0x4016) {
-        controller[0].write(data);
-        controller[1].write(data);
+        bus.controller[0].write(data);
+        bus.controller[1].write(data);
+    }
+    else if (address >= 0x4000 && address <= 0x4013 && address != 0x4010 &&
+             bus.apu_write_count < bus.apu_writes.size()) {
+        bus.apu_writes[bus.apu_write_count++] = {bus.system_clock_counter, address, data};
     }
     else if (address >= 0x4000 && address <= 0x4017) {
-        apu.cpu_write(address, data);
+        // $4010, $4015 and $4017 can acknowledge IRQ or change when the next one comes.
+        bus.sync_apu(bus.system_clock_counter);
+        bus.apu.cpu_write(address, data);
+    }
+    else if (bus.cart) {
+        bus.cart->cpu_write(address, data);
     }
 }
 
-uint8_t Bus::cpu_read(uint16_t address) {
+uint8_t Bus::read_cartridge(Bus& bus, uint16_t address) {
     uint8_t data = 0x00;
-    if (cart && cart->cpu_read(address, data)) {
+    if (bus.cart) {
+        bus.cart->cpu_read(address, data);
     }
-    else if (address >= 0x0000 && address <= 0x1FFF) {
-        data = cpu_ram[address & 0x07FF];
-    } else if (address >= 0x2000 && address <= 0x3FFF) {
-        data = ppu.cpu_read(address & 0x0007);
+    return data;
+}
+
+// Mapper registers live under PRG ROM; remap when a write switched banks.
+// Bank and mirroring writes change what the PPU and DMC fetch, so they catch up
+// first; IRQ registers move the next mapper event.
+void Bus::write_cartridge(Bus& bus, uint16_t address, uint8_t data) {
+    bus.advance_ppu(bus.system_clock_counter + 1);
+    bus.advance_apu(bus.system_clock_counter);
+    if (bus.cart && bus.cart->cpu_write(address, data) &&
+        bus.cart->get_prg_bank_generation() != bus.prg_generation) {
+        bus.map_prg_rom();
     }
-    else if (address == 0x4016) {
-        data = controller[0].read();
+    bus.schedule_ppu();
+}
+
+void Bus::map_cartridge() {
+    for (size_t page = 0x60; page < 0x100; page++) {
+        pages[page] = {nullptr, nullptr, &Bus::read_cartridge, &Bus::write_cartridge};
     }
-    else if (address == 0x4015) {
-        data = apu.cpu_read(address);
+    if (!cart) {
+        return;
     }
-    else if (address == 0x4017) {
-        data = controller[1].read();
+    if (cart->prg_ram_size() > 0) {
+        for (size_t page = 0x60; page < 0x80; page++) {
+            uint8_t* memory = cart->prg_ram_data() + (((page - 0x60) << 8) % cart->prg_ram_size());
+            pages[page] = {memory, memory, nullptr, nullptr};
+        }
+    }
+    map_prg_rom();
+}
+
+void Bus::map_prg_rom() {
+    prg_generation = cart->get_prg_bank_generation();
+    // Banks are at least 8KB, so each 8KB window is contiguous in PRG ROM.
+    for (uint32_t window = 0x8000; window < 0x10000; window += 0x2000) {
+        size_t offset = 0;
+        const bool mapped = cart->prg_rom_offset(static_cast<uint16_t>(window), offset);
+        for (uint32_t page = window >> 8; page < ((window + 0x2000) >> 8); page++) {
+            pages[page].read = mapped ? cart->prg_rom() + offset + ((page << 8) - window) : nullptr;
+        }
+    }
+}
+
+// Side-effect free read for the tracer; I/O registers read as $FF.
+uint8_t Bus::peek(uint16_t address) {
+    const MemoryPage& page = pages[address >> 8];
+    if (page.read) {
+        return page.read[address & 0x00FF];
+    }
+    uint8_t data = 0xFF;
+    if (cart) {
+        cart->cpu_read(address, data);
     }
     return data;
 }
 
 Bus::Bus() {
+    for (size_t page = 0x00; page < 0x20; page++) {
+        uint8_t* memory = cpu_ram.data() + ((page & 0x07) << 8);
+        pages[page] = {memory, memory, nullptr, nullptr};
+    }
+    for (size_t page = 0x20; page < 0x40; page++) {
+        pages[page] = {nullptr, nullptr, &Bus::read_ppu, &Bus::write_ppu};
+    }
+    for (size_t page = 0x40; page < 0x60; page++) {
+        pages[page] = {nullptr, nullptr, &Bus::read_io, &Bus::write_io};
+    }
+    map_cartridge();
     cpu.connect_bus(this);
     ppu.connect_bus(this);
     apu.connect_bus(this);
+    schedule_ppu();
+    schedule_apu();
 }
 
 void Bus::insert_cartridge(Cartridge* cartridge) {
+    if (cart && cart->get_mapper()) {
+        cart->get_mapper()->connect_irq(nullptr, nullptr);
+    }
     this->cart = cartridge;
-    set_cartridge_irq_line(false);
+    map_cartridge();
+    ppu.connect_cartridge(cartridge);
+    if (cart && cart->get_mapper()) {
+        cart->get_mapper()->connect_irq(&Bus::cartridge_irq, this);
+    }
+    set_cartridge_irq_line(cart && cart->irq_asserted());
+    schedule_ppu();
 }
 
 void Bus::nmi(bool defer_one_instruction) {
@@ -92,13 +344,15 @@ void Bus::nmi(bool defer_one_instruction) {
 }
 
 void Bus::set_irq_line(bool asserted) {
-    apu_irq_line = asserted;
-    cpu.set_irq_line(apu_irq_line || cartridge_irq_line);
+    cpu.set_irq_line(CPU::IRQ_APU, asserted);
 }
 
 void Bus::set_cartridge_irq_line(bool asserted) {
-    cartridge_irq_line = asserted;
-    cpu.set_irq_line(apu_irq_line || cartridge_irq_line);
+    cpu.set_irq_line(CPU::IRQ_CARTRIDGE, asserted);
+}
+
+void Bus::cartridge_irq(void* bus, bool asserted) {
+    static_cast<Bus*>(bus)->set_cartridge_irq_line(asserted);
 }
 
 bool Bus::ppu_read(uint16_t address, uint8_t& data) {
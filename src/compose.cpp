@@ -0,0 +1,243 @@
+#include <compose.h>
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define EMUNES_COMPOSE_SSE2 1
+#include <emmintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define EMUNES_COMPOSE_AVX2 1
+#include <immintrin.h>
+#endif
+#endif
+
+namespace {
+
+bool compose_scalar(const uint8_t* bg, const uint8_t* sprite, uint8_t mask, uint8_t* out) {
+    bool hit = false;
+    for (int x = 0; x < 256; x++) {
+        uint8_t b = bg[x];
+        uint8_t s = sprite[x];
+        if (x < 8) {
+            if (!(mask & 0x02)) b = 0;
+            if (!(mask & 0x04)) s = 0;
+        }
+        uint8_t color = (b & 0x03) ? b : 0;
+        if (s & 0x03) {
+            if (!(b & 0x03) || (s & 0x20)) {
+                color = s & 0x1F;
+            }
+            // With either left column hidden the masks above already rule
+            // out a hit at x 0-7.
+            if ((b & 0x03) && (s & 0x40) && x < 255) {
+                hit = true;
+            }
+        }
+        out[x] = color;
+    }
+    return hit;
+}
+
+#ifdef EMUNES_COMPOSE_SSE2
+// compose_scalar() 16 pixels at a time.
+bool compose_sse2(const uint8_t* bg, const uint8_t* sprite, uint8_t mask, uint8_t* out) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i pixel = _mm_set1_epi8(0x03);
+    const __m128i colour = _mm_set1_epi8(0x1F);
+    const __m128i front = _mm_set1_epi8(0x20);
+    const __m128i zero_sprite = _mm_set1_epi8(0x40);
+    const __m128i left = _mm_set_epi64x(-1, 0);
+    const __m128i bg_left = (mask & 0x02) ? _mm_set1_epi8(-1) : left;
+    const __m128i sprite_left = (mask & 0x04) ? _mm_set1_epi8(-1) : left;
+    const __m128i last = _mm_srli_si128(_mm_set1_epi8(-1), 1);
+    int hits = 0;
+    for (int x = 0; x < 256; x += 16) {
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bg + x));
+        __m128i s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(sprite + x));
+        if (x == 0) {
+            b = _mm_and_si128(b, bg_left);
+            s = _mm_and_si128(s, sprite_left);
+        }
+        const __m128i bg_clear = _mm_cmpeq_epi8(_mm_and_si128(b, pixel), zero);
+        const __m128i sprite_clear = _mm_cmpeq_epi8(_mm_and_si128(s, pixel), zero);
+        const __m128i in_front = _mm_cmpeq_epi8(_mm_and_si128(s, front), front);
+        const __m128i use_sprite = _mm_andnot_si128(sprite_clear, _mm_or_si128(bg_clear, in_front));
+        const __m128i bg_colour = _mm_andnot_si128(bg_clear, b);
+        const __m128i sprite_colour = _mm_and_si128(s, colour);
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + x),
+                         _mm_or_si128(_mm_and_si128(use_sprite, sprite_colour), _mm_andnot_si128(use_sprite, bg_colour)));
+        __m128i hit = _mm_andnot_si128(bg_clear, _mm_cmpeq_epi8(_mm_and_si128(s, zero_sprite), zero_sprite));
+        if (x == 240) {
+            hit = _mm_and_si128(hit, last);
+        }
+        hits |= _mm_movemask_epi8(hit);
+    }
+    return hits != 0;
+}
+#endif
+
+#ifdef EMUNES_COMPOSE_AVX2
+// compose_scalar() 32 pixels at a time.
+__attribute__((target("avx2")))
+bool compose_avx2(const uint8_t* bg, const uint8_t* sprite, uint8_t mask, uint8_t* out) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i pixel = _mm256_set1_epi8(0x03);
+    const __m256i colour = _mm256_set1_epi8(0x1F);
+    const __m256i front = _mm256_set1_epi8(0x20);
+    const __m256i zero_sprite = _mm256_set1_epi8(0x40);
+    const __m256i left = _mm256_set_epi64x(-1, -1, -1, 0);
+    const __m256i bg_left = (mask & 0x02) ? _mm256_set1_epi8(-1) : left;
+    const __m256i sprite_left = (mask & 0x04) ? _mm256_set1_epi8(-1) : left;
+    const __m256i last = _mm256_set_epi64x(0x00FFFFFFFFFFFFFF, -1, -1, -1);
+    int hits = 0;
+    for (int x = 0; x < 256; x += 32) {
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bg + x));
+        __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(sprite + x));
+        if (x == 0) {
+            b = _mm256_and_si256(b, bg_left);
+            s = _mm256_and_si256(s, sprite_left);
+        }
+        const __m256i bg_clear = _mm256_cmpeq_epi8(_mm256_and_si256(b, pixel), zero);
+        const __m256i sprite_clear = _mm256_cmpeq_epi8(_mm256_and_si256(s, pixel), zero);
+        const __m256i in_front = _mm256_cmpeq_epi8(_mm256_and_si256(s, front), front);
+        const __m256i use_sprite = _mm256_andnot_si256(sprite_clear, _mm256_or_si256(bg_clear, in_front));
+        const __m256i bg_colour = _mm256_andnot_si256(bg_clear, b);
+        const __m256i sprite_colour = _mm256_and_si256(s, colour);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + x),
+                            _mm256_blendv_epi8(bg_colour, sprite_colour, use_sprite));
+        __m256i hit = _mm256_andnot_si256(bg_clear, _mm256_cmpeq_epi8(_mm256_and_si256(s, zero_sprite), zero_sprite));
+        if (x == 224) {
+            hit = _mm256_and_si256(hit, last);
+        }
+        hits |= _mm256_movemask_epi8(hit);
+    }
+    return hits != 0;
+}
+#endif
+
+} // namespace
+
+ComposeLine compose_kernel(ComposeKernel kernel) {
+    switch (kernel) {
+    case COMPOSE_SCALAR:
+        return compose_scalar;
+#ifdef EMUNES_COMPOSE_SSE2
+    case COMPOSE_SSE2:
+        return compose_sse2;
+#endif
+#ifdef EMUNES_COMPOSE_AVX2
+    case COMPOSE_AVX2:
+        return __builtin_cpu_supports("avx2") ? compose_avx2 : nullptr;
+#endif
+    default:
+        return nullptr;
+    }
+}
+
+namespace {
+
+struct CalibrationLine {
+    uint8_t bg[256];
+    uint8_t sprite[256];
+    uint8_t mask;
+};
+
+// A frame's worth of lines like compose_bench builds: the background from a
+// few tile rows with half of the tiles blank, and 8 sprites a line.
+std::vector<CalibrationLine> make_calibration_lines() {
+    uint32_t state = 0x12345678;
+    const auto next = [&state] {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return state;
+    };
+    uint8_t tile_rows[4][8];
+    for (auto& row : tile_rows) {
+        for (uint8_t& pixel : row) {
+            pixel = static_cast<uint8_t>(next() & 0x03);
+        }
+    }
+    std::vector<CalibrationLine> lines(240);
+    for (CalibrationLine& line : lines) {
+        for (int tile = 0; tile < 32; tile++) {
+            const uint32_t random = next();
+            const uint8_t* row = tile_rows[random & 3];
+            for (int i = 0; i < 8; i++) {
+                line.bg[tile * 8 + i] = (random & 4) ? 0 : static_cast<uint8_t>((random & 0x30) >> 2 | row[i]);
+            }
+        }
+        std::fill(line.sprite, line.sprite + 256, 0);
+        for (int i = 7; i >= 0; i--) {
+            const uint32_t random = next();
+            const int x = static_cast<int>(random & 0xFF);
+            const uint8_t* row = tile_rows[(random >> 8) & 3];
+            const uint8_t flags = static_cast<uint8_t>(0x10 | ((random >> 16) & 0x2C) | (i == 0 ? 0x40 : 0x00));
+            for (int j = 0; j < 8 && x + j < 256; j++) {
+                if (row[j]) {
+                    line.sprite[x + j] = flags | row[j];
+                }
+            }
+        }
+        line.mask = static_cast<uint8_t>(0x18 | (next() & 0x06));
+    }
+    return lines;
+}
+
+// Best of a few passes over the lines, after one to warm up.
+double time_kernel(ComposeLine compose, const std::vector<CalibrationLine>& lines) {
+    uint8_t out[256];
+    double best = 0;
+    for (int pass = 0; pass < 5; pass++) {
+        const auto start = std::chrono::steady_clock::now();
+        for (const CalibrationLine& line : lines) {
+            compose(line.bg, line.sprite, line.mask, out);
+        }
+        const double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (pass == 1 || elapsed < best) {
+            best = elapsed;
+        }
+    }
+    return best;
+}
+
+// Scalar unless a vector kernel is clearly faster on this CPU, so that timing
+// noise does not pick one that is not.
+ComposeKernel fastest_compose_kernel() {
+    const std::vector<CalibrationLine> lines = make_calibration_lines();
+    ComposeKernel fastest = COMPOSE_SCALAR;
+    double fastest_time = time_kernel(compose_scalar, lines);
+    for (int kernel = COMPOSE_SCALAR + 1; kernel < COMPOSE_KERNEL_COUNT; kernel++) {
+        const ComposeLine compose = compose_kernel(static_cast<ComposeKernel>(kernel));
+        if (!compose) {
+            continue;
+        }
+        const double time = time_kernel(compose, lines);
+        if (time < 0.9 * fastest_time) {
+            fastest = static_cast<ComposeKernel>(kernel);
+            fastest_time = time;
+        }
+    }
+    return fastest;
+}
+
+} // namespace
+
+ComposeKernel best_compose_kernel() {
+    static const ComposeKernel best = fastest_compose_kernel();
+    return best;
+}
+
+const char* compose_kernel_name(ComposeKernel kernel) {
+    switch (kernel) {
+    case COMPOSE_SCALAR:
+        return "scalar";
+    case COMPOSE_SSE2:
+        return "SSE2";
+    case COMPOSE_AVX2:
+        return "AVX2";
+    default:
+        return "?";
+    }
+}
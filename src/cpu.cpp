@@ -1,69 +1,270 @@
+#include <algorithm>
 #include <cstdint>
 #include <iostream>
 #include <unordered_map>
 #include <cpu.h>
 #include <bus.h>
+#include <jit.h>
+#include <trace.h>
+#include <sampler.h>
 
-static const uint8_t cycles[256] = {
-    // 0  1  2  3  4  5  6  7  8  9  A  B  C  D  E  F
-       7, 6, 0, 0, 0, 3, 5, 0, 3, 2, 2, 0, 0, 4, 6, 0, // 0x
-       2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // 1x
-       6, 6, 0, 0, 3, 3, 5, 0, 4, 2, 2, 0, 4, 4, 6, 0, // 2x
-       2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // 3x
-       6, 6, 0, 0, 0, 3, 5, 0, 3, 2, 2, 0, 3, 4, 6, 0, // 4x
-       2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // 5x
-       6, 6, 0, 0, 0, 3, 5, 0, 4, 2, 2, 0, 5, 4, 6, 0, // 6x
-       2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // 7x
-       0, 6, 0, 0, 3, 3, 3, 0, 2, 0, 2, 0, 4, 4, 4, 0, // 8x
-       2, 6, 0, 0, 4, 4, 4, 0, 2, 5, 2, 0, 0, 5, 0, 0, // 9x
-       2, 6, 2, 0, 3, 3, 3, 0, 2, 2, 2, 0, 4, 4, 4, 0, // Ax
-       2, 5, 0, 0, 4, 4, 4, 0, 2, 4, 2, 0, 4, 4, 4, 0, // Bx
-       2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0, // Cx
-       2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0, // Dx
-       2, 6, 0, 0, 3, 3, 5, 0, 2, 2, 2, 0, 4, 4, 6, 0, // Ex
-       2, 5, 0, 0, 0, 4, 6, 0, 2, 4, 0, 0, 0, 4, 7, 0  // Fx
-};
+CPU::CPU() = default;
 
+CPU::~CPU() = default;
+
+// Zero page and the stack are always internal RAM, so they skip the bus.
 uint16_t CPU::read16_zeropage(uint16_t address) {
+    const uint8_t* ram = bus->get_ram();
     uint8_t addr_low = address & 0x00FF;
-    uint8_t low_byte = read(addr_low);
+    uint8_t low_byte = ram[addr_low];
     uint8_t addr_high = (addr_low + 1) & 0x00FF;
-    uint8_t high_byte = read(addr_high);
+    uint8_t high_byte = ram[addr_high];
 
     return (high_byte << 8) | low_byte;
 }
 
-uint16_t CPU::addr_abs_x(int& cycles) {
-    uint16_t base_addr = fetch16();
-    uint16_t final_addr = base_addr + X;
+template <CPU::Mode M>
+inline uint16_t CPU::effective_address(uint16_t operand, bool& page_crossed) {
+    if constexpr (M == Mode::ZP0 || M == Mode::ABS) {
+        return operand;
+    } else if constexpr (M == Mode::ZPX) {
+        return (operand + X) & 0x00FF;
+    } else if constexpr (M == Mode::ZPY) {
+        return (operand + Y) & 0x00FF;
+    } else if constexpr (M == Mode::ABX || M == Mode::ABY) {
+        uint16_t final_addr = operand + (M == Mode::ABX ? X : Y);
+        page_crossed = (operand & 0xFF00) != (final_addr & 0xFF00);
+        return final_addr;
+    } else if constexpr (M == Mode::IND) {
+        uint16_t low = read(operand);
+        uint16_t high_addr = (operand & 0xFF00) | ((operand + 1) & 0x00FF);
+        uint16_t high = read(high_addr);
+        return (high << 8) | low;
+    } else if constexpr (M == Mode::IZX) {
+        return read16_zeropage((operand + X) & 0x00FF);
+    } else if constexpr (M == Mode::IZY) {
+        uint16_t base_addr = read16_zeropage(operand);
+        uint16_t final_addr = base_addr + Y;
+        page_crossed = (base_addr & 0xFF00) != (final_addr & 0xFF00);
+        return final_addr;
+    } else {
+        static_assert(M == Mode::ABS, "addressing mode has no effective address");
+        return operand;
+    }
+}
 
-    if ((base_addr & 0xFF00) != (final_addr & 0xFF00)) {
-        cycles++;
+template <void (CPU::*Operation)(uint8_t), CPU::Mode M>
+uint8_t CPU::read_op(CPU& cpu, uint16_t operand) {
+    if constexpr (M == Mode::IMM) {
+        (cpu.*Operation)(static_cast<uint8_t>(operand));
+        return 0;
+    } else {
+        bool page_crossed = false;
+        uint16_t address = cpu.effective_address<M>(operand, page_crossed);
+        if constexpr (is_zero_page(M)) {
+            (cpu.*Operation)(cpu.bus->get_ram()[address]);
+        } else {
+            (cpu.*Operation)(cpu.read(address));
+        }
+        return page_crossed ? 1 : 0;
     }
-    return final_addr;
 }
 
-uint16_t CPU::addr_abs_y(int& cycles) {
-    uint16_t base_addr = fetch16();
-    uint16_t final_addr = base_addr + Y;
+template <uint8_t (CPU::*Operation)(uint8_t), CPU::Mode M>
+uint8_t CPU::modify_op(CPU& cpu, uint16_t operand) {
+    if constexpr (M == Mode::ACC) {
+        cpu.A = (cpu.*Operation)(cpu.A);
+    } else {
+        bool page_crossed = false;
+        uint16_t address = cpu.effective_address<M>(operand, page_crossed);
+        if constexpr (is_zero_page(M)) {
+            uint8_t* ram = cpu.bus->get_ram();
+            ram[address] = (cpu.*Operation)(ram[address]);
+        } else {
+            cpu.write(address, (cpu.*Operation)(cpu.read(address)));
+        }
+    }
+    return 0;
+}
 
-    if ((base_addr & 0xFF00) != (final_addr & 0xFF00)) {
-        cycles++;
+template <uint8_t CPU::*Register, CPU::Mode M>
+uint8_t CPU::store_op(CPU& cpu, uint16_t operand) {
+    bool page_crossed = false;
+    if constexpr (is_zero_page(M)) {
+        cpu.bus->get_ram()[cpu.effective_address<M>(operand, page_crossed)] = cpu.*Register;
+    } else {
+        cpu.write(cpu.effective_address<M>(operand, page_crossed), cpu.*Register);
     }
-    return final_addr;
+    return 0;
+}
+
+template <void (CPU::*Operation)(uint16_t), CPU::Mode M>
+uint8_t CPU::jump_op(CPU& cpu, uint16_t operand) {
+    bool page_crossed = false;
+    (cpu.*Operation)(cpu.effective_address<M>(operand, page_crossed));
+    return 0;
 }
 
-uint16_t CPU::addr_ind_y(int& cycles) {
-    uint8_t zp_addr = fetch();
-    uint16_t base_addr = read16_zeropage(zp_addr);
-    uint16_t final_addr = base_addr + Y;
+template <void (CPU::*Operation)()>
+uint8_t CPU::implied_op(CPU& cpu, uint16_t) {
+    (cpu.*Operation)();
+    return 0;
+}
 
-    if ((base_addr & 0xFF00) != (final_addr & 0xFF00)) {
-        cycles++;
+template <uint8_t Flag, bool Value>
+uint8_t CPU::branch_op(CPU& cpu, uint16_t operand) {
+    if (cpu.Getflag(Flag) != Value) {
+        return 0;
     }
-    return final_addr;
+    uint16_t target_addr = cpu.PC + static_cast<int8_t>(operand);
+    uint8_t additional_cycles = ((cpu.PC & 0xFF00) != (target_addr & 0xFF00)) ? 2 : 1;
+    cpu.PC = target_addr;
+    return additional_cycles;
+}
+
+uint8_t CPU::illegal_op(CPU&, uint16_t) {
+    return 0;
+}
+
+template <void (CPU::*Operation)(uint8_t)>
+uint8_t CPU::read_value(CPU& cpu, uint8_t value) {
+    (cpu.*Operation)(value);
+    return 0;
+}
+
+template <uint8_t (CPU::*Operation)(uint8_t)>
+uint8_t CPU::modify_value(CPU& cpu, uint8_t value) {
+    return (cpu.*Operation)(value);
+}
+
+template <uint8_t CPU::*Register>
+uint8_t CPU::register_value(CPU& cpu, uint8_t) {
+    return cpu.*Register;
+}
+
+template <void (CPU::*Operation)()>
+uint8_t CPU::implied_value(CPU& cpu, uint8_t) {
+    (cpu.*Operation)();
+    return 0;
 }
 
+template <uint8_t Flag, bool Value>
+uint8_t CPU::branch_value(CPU& cpu, uint8_t) {
+    return cpu.Getflag(Flag) == Value ? 1 : 0;
+}
+
+uint8_t CPU::no_value(CPU&, uint8_t) {
+    return 0;
+}
+
+constexpr std::array<CPU::Instruction, 256> CPU::make_instruction_table() {
+    std::array<Instruction, 256> table{};
+    for (Instruction& entry : table) {
+        // Unofficial opcodes run as one-byte, two-cycle NOPs, as in the cycle-stepped core.
+        entry = {"???", Kind::ILLEGAL, Mode::IMP, 2, false, &CPU::illegal_op, &CPU::no_value};
+    }
+
+#define READ(opcode, op, mode, cycles, penalty) \
+    table[opcode] = {#op, Kind::READ, Mode::mode, cycles, penalty, \
+                     &CPU::read_op<&CPU::op, Mode::mode>, &CPU::read_value<&CPU::op>}
+#define MODIFY(opcode, op, mode, cycles) \
+    table[opcode] = {#op, Kind::MODIFY, Mode::mode, cycles, false, \
+                     &CPU::modify_op<&CPU::op, Mode::mode>, &CPU::modify_value<&CPU::op>}
+#define STORE(opcode, op, reg, mode, cycles) \
+    table[opcode] = {#op, Kind::STORE, Mode::mode, cycles, false, \
+                     &CPU::store_op<&CPU::reg, Mode::mode>, &CPU::register_value<&CPU::reg>}
+#define JUMP(opcode, op, mode, cycles) \
+    table[opcode] = {#op, Kind::JUMP, Mode::mode, cycles, false, \
+                     &CPU::jump_op<&CPU::op, Mode::mode>, &CPU::no_value}
+#define IMPLIED(opcode, op, cycles) \
+    table[opcode] = {#op, Kind::IMPLIED, Mode::IMP, cycles, false, \
+                     &CPU::implied_op<&CPU::op>, &CPU::implied_value<&CPU::op>}
+#define BRANCH(opcode, op, flag, value) \
+    table[opcode] = {#op, Kind::BRANCH, Mode::REL, 2, true, \
+                     &CPU::branch_op<flag, value>, &CPU::branch_value<flag, value>}
+
+    READ(0x69, ADC, IMM, 2, false); READ(0x65, ADC, ZP0, 3, false); READ(0x75, ADC, ZPX, 4, false);
+    READ(0x6D, ADC, ABS, 4, false); READ(0x7D, ADC, ABX, 4, true);  READ(0x79, ADC, ABY, 4, true);
+    READ(0x61, ADC, IZX, 6, false); READ(0x71, ADC, IZY, 5, true);
+
+    READ(0x29, AND, IMM, 2, false); READ(0x25, AND, ZP0, 3, false); READ(0x35, AND, ZPX, 4, false);
+    READ(0x2D, AND, ABS, 4, false); READ(0x3D, AND, ABX, 4, true);  READ(0x39, AND, ABY, 4, true);
+    READ(0x21, AND, IZX, 6, false); READ(0x31, AND, IZY, 5, true);
+
+    READ(0xC9, CMP, IMM, 2, false); READ(0xC5, CMP, ZP0, 3, false); READ(0xD5, CMP, ZPX, 4, false);
+    READ(0xCD, CMP, ABS, 4, false); READ(0xDD, CMP, ABX, 4, true);  READ(0xD9, CMP, ABY, 4, true);
+    READ(0xC1, CMP, IZX, 6, false); READ(0xD1, CMP, IZY, 5, true);
+
+    READ(0x49, EOR, IMM, 2, false); READ(0x45, EOR, ZP0, 3, false); READ(0x55, EOR, ZPX, 4, false);
+    READ(0x4D, EOR, ABS, 4, false); READ(0x5D, EOR, ABX, 4, true);  READ(0x59, EOR, ABY, 4, true);
+    READ(0x41, EOR, IZX, 6, false); READ(0x51, EOR, IZY, 5, true);
+
+    READ(0xA9, LDA, IMM, 2, false); READ(0xA5, LDA, ZP0, 3, false); READ(0xB5, LDA, ZPX, 4, false);
+    READ(0xAD, LDA, ABS, 4, false); READ(0xBD, LDA, ABX, 4, true);  READ(0xB9, LDA, ABY, 4, true);
+    READ(0xA1, LDA, IZX, 6, false); READ(0xB1, LDA, IZY, 5, true);
+
+    READ(0x09, ORA, IMM, 2, false); READ(0x05, ORA, ZP0, 3, false); READ(0x15, ORA, ZPX, 4, false);
+    READ(0x0D, ORA, ABS, 4, false); READ(0x1D, ORA, ABX, 4, true);  READ(0x19, ORA, ABY, 4, true);
+    READ(0x01, ORA, IZX, 6, false); READ(0x11, ORA, IZY, 5, true);
+
+    READ(0xE9, SBC, IMM, 2, false); READ(0xE5, SBC, ZP0, 3, false); READ(0xF5, SBC, ZPX, 4, false);
+    READ(0xED, SBC, ABS, 4, false); READ(0xFD, SBC, ABX, 4, true);  READ(0xF9, SBC, ABY, 4, true);
+    READ(0xE1, SBC, IZX, 6, false); READ(0xF1, SBC, IZY, 5, true);
+
+    READ(0xA2, LDX, IMM, 2, false); READ(0xA6, LDX, ZP0, 3, false); READ(0xB6, LDX, ZPY, 4, false);
+    READ(0xAE, LDX, ABS, 4, false); READ(0xBE, LDX, ABY, 4, true);
+
+    READ(0xA0, LDY, IMM, 2, false); READ(0xA4, LDY, ZP0, 3, false); READ(0xB4, LDY, ZPX, 4, false);
+    READ(0xAC, LDY, ABS, 4, false); READ(0xBC, LDY, ABX, 4, true);
+
+    READ(0xE0, CPX, IMM, 2, false); READ(0xE4, CPX, ZP0, 3, false); READ(0xEC, CPX, ABS, 4, false);
+    READ(0xC0, CPY, IMM, 2, false); READ(0xC4, CPY, ZP0, 3, false); READ(0xCC, CPY, ABS, 4, false);
+    READ(0x24, BIT, ZP0, 3, false); READ(0x2C, BIT, ABS, 4, false);
+
+    MODIFY(0x0A, ASL, ACC, 2); MODIFY(0x06, ASL, ZP0, 5); MODIFY(0x16, ASL, ZPX, 6);
+    MODIFY(0x0E, ASL, ABS, 6); MODIFY(0x1E, ASL, ABX, 7);
+    MODIFY(0x4A, LSR, ACC, 2); MODIFY(0x46, LSR, ZP0, 5); MODIFY(0x56, LSR, ZPX, 6);
+    MODIFY(0x4E, LSR, ABS, 6); MODIFY(0x5E, LSR, ABX, 7);
+    MODIFY(0x2A, ROL, ACC, 2); MODIFY(0x26, ROL, ZP0, 5); MODIFY(0x36, ROL, ZPX, 6);
+    MODIFY(0x2E, ROL, ABS, 6); MODIFY(0x3E, ROL, ABX, 7);
+    MODIFY(0x6A, ROR, ACC, 2); MODIFY(0x66, ROR, ZP0, 5); MODIFY(0x76, ROR, ZPX, 6);
+    MODIFY(0x6E, ROR, ABS, 6); MODIFY(0x7E, ROR, ABX, 7);
+    MODIFY(0xE6, INC, ZP0, 5); MODIFY(0xF6, INC, ZPX, 6); MODIFY(0xEE, INC, ABS, 6); MODIFY(0xFE, INC, ABX, 7);
+    MODIFY(0xC6, DEC, ZP0, 5); MODIFY(0xD6, DEC, ZPX, 6); MODIFY(0xCE, DEC, ABS, 6); MODIFY(0xDE, DEC, ABX, 7);
+
+    STORE(0x85, STA, A, ZP0, 3); STORE(0x95, STA, A, ZPX, 4); STORE(0x8D, STA, A, ABS, 4);
+    STORE(0x9D, STA, A, ABX, 5); STORE(0x99, STA, A, ABY, 5); STORE(0x81, STA, A, IZX, 6);
+    STORE(0x91, STA, A, IZY, 6);
+    STORE(0x86, STX, X, ZP0, 3); STORE(0x96, STX, X, ZPY, 4); STORE(0x8E, STX, X, ABS, 4);
+    STORE(0x84, STY, Y, ZP0, 3); STORE(0x94, STY, Y, ZPX, 4); STORE(0x8C, STY, Y, ABS, 4);
+
+    JUMP(0x4C, JMP, ABS, 3); JUMP(0x6C, JMP, IND, 5); JUMP(0x20, JSR, ABS, 6);
+
+    BRANCH(0x90, BCC, FLAG_C, false); BRANCH(0xB0, BCS, FLAG_C, true);
+    BRANCH(0xD0, BNE, FLAG_Z, false); BRANCH(0xF0, BEQ, FLAG_Z, true);
+    BRANCH(0x10, BPL, FLAG_N, false); BRANCH(0x30, BMI, FLAG_N, true);
+    BRANCH(0x50, BVC, FLAG_V, false); BRANCH(0x70, BVS, FLAG_V, true);
+
+    IMPLIED(0x00, BRK, 7); IMPLIED(0x40, RTI, 6); IMPLIED(0x60, RTS, 6); IMPLIED(0xEA, NOP, 2);
+    IMPLIED(0x18, CLC, 2); IMPLIED(0xD8, CLD, 2); IMPLIED(0x58, CLI, 2); IMPLIED(0xB8, CLV, 2);
+    IMPLIED(0x38, SEC, 2); IMPLIED(0xF8, SED, 2); IMPLIED(0x78, SEI, 2);
+    IMPLIED(0xCA, DEX, 2); IMPLIED(0x88, DEY, 2); IMPLIED(0xE8, INX, 2); IMPLIED(0xC8, INY, 2);
+    IMPLIED(0xAA, TAX, 2); IMPLIED(0xA8, TAY, 2); IMPLIED(0xBA, TSX, 2);
+    IMPLIED(0x8A, TXA, 2); IMPLIED(0x9A, TXS, 2); IMPLIED(0x98, TYA, 2);
+    IMPLIED(0x48, PHA, 3); IMPLIED(0x08, PHP, 3); IMPLIED(0x68, PLA, 4); IMPLIED(0x28, PLP, 4);
+
+#undef READ
+#undef MODIFY
+#undef STORE
+#undef JUMP
+#undef IMPLIED
+#undef BRANCH
+
+    return table;
+}
+
+const std::array<CPU::Instruction, 256> CPU::instruction_table = CPU::make_instruction_table();
+
 uint8_t CPU::read(uint16_t address) {
     return bus->cpu_read(address);
 }
@@ -83,21 +284,132 @@ uint16_t CPU::fetch16() {
 }
 
 bool CPU::Getflag(uint8_t flag) {
+    if (flag == FLAG_N) {
+        return (nz & 0x8000) != 0;
+    }
+    if (flag == FLAG_Z) {
+        return (nz & 0x00FF) == 0;
+    }
     return (status & flag) != 0;
 }
 
 void CPU::Setflag(uint8_t flag, bool value) {
-    if (value)
+    if (flag == FLAG_N) {
+        nz = value ? (nz | 0x8000) : (nz & 0x7FFF);
+    } else if (flag == FLAG_Z) {
+        nz = value ? (nz & 0xFF00) : (nz | 0x0001);
+    } else if (value) {
         status |= flag;
-    else
+    } else {
         status &= ~flag;
+    }
+}
+
+uint8_t CPU::pack_status() const {
+    return status | ((nz & 0x8000) ? FLAG_N : 0) | ((nz & 0x00FF) == 0 ? FLAG_Z : 0);
+}
+
+void CPU::unpack_status(uint8_t value) {
+    status = value & ~(FLAG_N | FLAG_Z);
+    nz = static_cast<uint16_t>(((value & FLAG_N) << 8) | ((value & FLAG_Z) ? 0x00 : 0x01));
+}
+
+uint8_t CPU::get_status() const {
+    return pack_status();
+}
+
+CPU::State CPU::get_state() const {
+    return State{bus->get_timestamp(), PC, A, X, Y, pack_status(), SP};
 }
 
 void CPU::log_status() {
     std::cout << "PC: " << std::hex << PC << " A: " << std::hex << +A
         << " X: " << std::hex << +X << " Y: " << std::hex << +Y
-        << " SP: " << std::hex << +SP << " Status: " << std::hex << +status <<std::endl;
+        << " SP: " << std::hex << +SP << " Status: " << std::hex << +pack_status() <<std::endl;
+}
+
+// Called with PC on the opcode, before anything of the instruction has run.
+void CPU::trace_instruction() {
+    TraceRecord record{};
+    record.cycle = bus->get_timestamp() / 3;
+    record.pc = PC;
+    record.a = A;
+    record.x = X;
+    record.y = Y;
+    record.p = pack_status();
+    record.sp = SP;
+    // The PPU has already run the first dot of this CPU cycle.
+    bus->sync_ppu(bus->get_timestamp() + 1);
+    int scanline = bus->ppu.scanline;
+    int dot = bus->ppu.cycle - 1;
+    if (dot < 0) {
+        dot = 340;
+        scanline = scanline == -1 ? 260 : scanline - 1;
+    }
+    record.scanline = static_cast<int16_t>(scanline);
+    record.dot = static_cast<uint16_t>(dot);
+
+    const Instruction& instruction = instruction_table[bus->peek(PC)];
+    const uint8_t length = 1 + operand_bytes(instruction.mode);
+    for (uint8_t i = 0; i < length; i++) {
+        record.bytes[i] = bus->peek(static_cast<uint16_t>(PC + i));
+    }
+    const uint16_t operand = static_cast<uint16_t>(record.bytes[1] | (length > 2 ? record.bytes[2] << 8 : 0));
+    auto peek16_zeropage = [this](uint16_t address) {
+        return static_cast<uint16_t>(bus->peek(address & 0x00FF) | (bus->peek((address + 1) & 0x00FF) << 8));
+    };
+
+    switch (instruction.mode) {
+    case Mode::ZP0: record.address = operand; break;
+    case Mode::ZPX: record.address = (operand + X) & 0x00FF; break;
+    case Mode::ZPY: record.address = (operand + Y) & 0x00FF; break;
+    case Mode::ABS: record.address = operand; break;
+    case Mode::ABX: record.address = static_cast<uint16_t>(operand + X); break;
+    case Mode::ABY: record.address = static_cast<uint16_t>(operand + Y); break;
+    case Mode::IND:
+        record.address = static_cast<uint16_t>(bus->peek(operand) |
+            (bus->peek((operand & 0xFF00) | ((operand + 1) & 0x00FF)) << 8));
+        break;
+    case Mode::IZX: record.address = peek16_zeropage(operand + X); break;
+    case Mode::IZY:
+        record.pointer = peek16_zeropage(operand);
+        record.address = static_cast<uint16_t>(record.pointer + Y);
+        break;
+    case Mode::REL: record.address = static_cast<uint16_t>(PC + 2 + static_cast<int8_t>(operand)); break;
+    default: break;
+    }
+    record.value = bus->peek(record.address);
+
+    tracer->record(record);
+}
+
+const char* CPU::mode_name(Mode mode) {
+    static const char* const names[] = {"IMP", "ACC", "IMM", "ZP0", "ZPX", "ZPY", "ABS",
+                                        "ABX", "ABY", "IND", "IZX", "IZY", "REL"};
+    return names[static_cast<int>(mode)];
+}
+
+#ifdef EMUNES_PROFILE
+void CPU::profile_instruction(uint8_t opcode, uint8_t cycles) {
+    const Instruction& instruction = instruction_table[opcode];
+    OpcodeProfile& entry = profile.opcodes[opcode];
+    entry.executions++;
+    entry.cycles += cycles;
+    if (instruction.page_penalty) {
+        const uint8_t additional_cycles = cycles - instruction.cycles;
+        if (instruction.kind == Kind::BRANCH) {
+            if (additional_cycles > 0) {
+                entry.branches_taken++;
+            } else {
+                entry.branches_not_taken++;
+            }
+            entry.page_crosses += additional_cycles == 2 ? 1 : 0;
+        } else {
+            entry.page_crosses += additional_cycles;
+        }
+    }
 }
+#endif
 
 void CPU::reset() {
     uint16_t low_byte = read(0xFFFC);
@@ -108,12 +420,14 @@ void CPU::reset() {
     Y = 0;
     SP = 0xFD;
     status = 0x00 | FLAG_Ig | FLAG_I ;
+    nz = 0x0001;
 
     cycles_left = 7;
-}
-
-bool CPU::is_instruction_complete() {
-    return cycles_left == 0;
+#ifdef EMUNES_CYCLE_CPU
+    tcycle = 0;
+    in_interrupt = false;
+    interrupt_ready = false;
+#endif
 }
 
 void CPU::turn_off() {
@@ -124,6 +438,31 @@ void CPU::turn_on() {
     running = true;
 }
 
+void CPU::set_irq_line(IrqSource source, bool asserted) {
+    irq_inputs = static_cast<uint8_t>(asserted ? (irq_inputs | source) : (irq_inputs & ~source));
+}
+
+#ifndef EMUNES_CYCLE_CPU
+
+void CPU::set_jit_enabled(bool enabled) {
+#ifdef EMUNES_PROFILE
+    // Compiled blocks would bypass the counters.
+    enabled = false;
+#endif
+    if (!enabled) {
+        jit.reset();
+    } else if (!jit) {
+        jit = std::make_unique<Jit>(*this);
+        if (!jit->is_available()) {
+            jit.reset();
+        }
+    }
+}
+
+bool CPU::is_instruction_complete() {
+    return cycles_left == 0;
+}
+
 void CPU::nmi(bool defer_one_instruction) {
     nmi_pending = true;
     if (defer_one_instruction) {
@@ -131,697 +470,401 @@ void CPU::nmi(bool defer_one_instruction) {
     }
 }
 
-void CPU::set_irq_line(bool asserted) {
-    irq_line = asserted;
-}
-
 void CPU::clock() {
     if (cycles_left > 0) {
         cycles_left--;
         return;
     }
-    
+
+    cycles_left = step() - 1;
+}
+
+uint16_t CPU::fetch_operand(Mode mode) {
+    switch (operand_bytes(mode)) {
+    case 1:
+        return fetch();
+    case 2:
+        return fetch16();
+    default:
+        return 0;
+    }
+}
+
+inline uint8_t CPU::execute(uint8_t opcode) {
+    const Instruction& instruction = instruction_table[opcode];
+    uint16_t operand = fetch_operand(instruction.mode);
+    uint8_t additional_cycles = instruction.execute(*this, operand);
+    const uint8_t cycles = instruction.cycles + (instruction.page_penalty ? additional_cycles : 0);
+    profile_instruction(opcode, cycles);
+    return cycles;
+}
+
+uint8_t CPU::service_interrupts() {
     if (nmi_pending) {
         if (nmi_defer_one_instruction) {
             nmi_defer_one_instruction = false;
         } else {
-        nmi_pending = false;
-        
-        stack_push16(PC);
-        Setflag(FLAG_B, false);
-        Setflag(FLAG_Ig, true);
-        Setflag(FLAG_I, true);
-        stack_push(status);
-        PC = read16(0xFFFA);
-        
-        cycles_left = 8;
-        cycles_left--;
-        return;
+            nmi_pending = false;
+
+            const uint8_t return_sp = SP;
+            stack_push16(PC);
+            Setflag(FLAG_B, false);
+            Setflag(FLAG_Ig, true);
+            stack_push(pack_status());
+            Setflag(FLAG_I, true);
+            PC = read16(0xFFFA);
+            if (nmi_log) {
+                nmi_log->push_back(get_state());
+            }
+            if (sampler) {
+                sampler->enter(Sampler::Entry::NMI, PC, return_sp);
+            }
+            return 8;
         }
     }
 
-    if (irq_line && !Getflag(FLAG_I)) {
+    if (irq_inputs != 0 && !Getflag(FLAG_I)) {
+        const uint8_t return_sp = SP;
         stack_push16(PC);
         Setflag(FLAG_B, false);
         Setflag(FLAG_Ig, true);
+        stack_push(pack_status());
         Setflag(FLAG_I, true);
-        stack_push(status);
         PC = read16(0xFFFE);
+        if (sampler) {
+            sampler->enter(Sampler::Entry::IRQ, PC, return_sp);
+        }
+        return 7;
+    }
 
-        cycles_left = 7;
-        cycles_left--;
-        return;
+    return 0;
+}
+
+uint8_t CPU::step() {
+    if (uint8_t interrupt_cycles = service_interrupts()) {
+        return interrupt_cycles;
     }
-    
-    uint8_t opcode = fetch();
-    int instruction_cycles = cycles[opcode];
-    int additional_cycles = 0;
-    int8_t offset=0;
-    switch (opcode) {
-        case 0x69:
-            ADC(fetch());
-            break;
-        case 0x65:
-            ADC(read(fetch()));
-            break;
-        case 0x75:
-            ADC(read((fetch() + X)& 0xFF));
-            break;
-        case 0x6D:
-            ADC(read(fetch16()));
-            break;
-        case 0x7D:
-            ADC(read(addr_abs_x(additional_cycles)));
-            break;
-        case 0x79:
-            ADC(read(addr_abs_y(additional_cycles)));
-            break;
-        case 0x61:
-        {
-            uint8_t base_addr = fetch();
-            uint16_t lookup_addr = (base_addr + X) & 0x00FF;
-            uint16_t effective_addr = read16_zeropage(lookup_addr);
-            ADC(read(effective_addr));
+    if (tracer) {
+        trace_instruction();
+    }
+    if (sampler) {
+        sampler->sample(PC);
+    }
+    return execute(fetch());
+}
+
+#if defined(EMUNES_THREADED_DISPATCH) && (defined(__GNUC__) || defined(__clang__))
+
+#define EMUNES_OPCODE_ROW(X, hi) \
+    X(hi##0) X(hi##1) X(hi##2) X(hi##3) X(hi##4) X(hi##5) X(hi##6) X(hi##7) \
+    X(hi##8) X(hi##9) X(hi##A) X(hi##B) X(hi##C) X(hi##D) X(hi##E) X(hi##F)
+#define EMUNES_FOR_EACH_OPCODE(X) \
+    EMUNES_OPCODE_ROW(X, 0) EMUNES_OPCODE_ROW(X, 1) EMUNES_OPCODE_ROW(X, 2) EMUNES_OPCODE_ROW(X, 3) \
+    EMUNES_OPCODE_ROW(X, 4) EMUNES_OPCODE_ROW(X, 5) EMUNES_OPCODE_ROW(X, 6) EMUNES_OPCODE_ROW(X, 7) \
+    EMUNES_OPCODE_ROW(X, 8) EMUNES_OPCODE_ROW(X, 9) EMUNES_OPCODE_ROW(X, A) EMUNES_OPCODE_ROW(X, B) \
+    EMUNES_OPCODE_ROW(X, C) EMUNES_OPCODE_ROW(X, D) EMUNES_OPCODE_ROW(X, E) EMUNES_OPCODE_ROW(X, F)
+
+// Threaded dispatch: every opcode body ends with its own indirect jump to the
+// next handler, and the handler pointer is a compile-time constant so the
+// template instance is inlined into the body.
+int64_t CPU::run(int64_t cycles) {
+    static constexpr std::array<Instruction, 256> table = make_instruction_table();
+#define EMUNES_LABEL_ADDRESS(op) &&opcode_##op,
+    static const void* const labels[256] = { EMUNES_FOR_EACH_OPCODE(EMUNES_LABEL_ADDRESS) };
+#undef EMUNES_LABEL_ADDRESS
+
+    int64_t elapsed = 0;
+
+#define EMUNES_DISPATCH()                                                  \
+    while (elapsed < cycles) {                                             \
+        bus->begin_cpu_cycle();                                            \
+        if (uint8_t interrupt_cycles = service_interrupts()) {             \
+            elapsed += bus->end_cpu_cycles(interrupt_cycles);              \
+            continue;                                                      \
+        }                                                                  \
+        if (tracer) {                                                      \
+            trace_instruction();                                           \
+        }                                                                  \
+        if (sampler) {                                                     \
+            sampler->sample(PC);                                           \
+        }                                                                  \
+        goto *labels[fetch()];                                             \
+    }                                                                      \
+    return elapsed;
+
+    EMUNES_DISPATCH()
+
+#define EMUNES_OPCODE_BODY(op)                                             \
+    opcode_##op: {                                                         \
+        constexpr Instruction instruction = table[0x##op];                 \
+        uint16_t operand = fetch_operand(instruction.mode);                \
+        uint8_t additional_cycles = instruction.execute(*this, operand);   \
+        const uint8_t cycles = instruction.cycles +                        \
+            (instruction.page_penalty ? additional_cycles : 0);            \
+        profile_instruction(0x##op, cycles);                               \
+        elapsed += bus->end_cpu_cycles(cycles);                            \
+    }                                                                      \
+    EMUNES_DISPATCH()
+
+    EMUNES_FOR_EACH_OPCODE(EMUNES_OPCODE_BODY)
+
+#undef EMUNES_OPCODE_BODY
+#undef EMUNES_DISPATCH
+}
+
+#undef EMUNES_FOR_EACH_OPCODE
+#undef EMUNES_OPCODE_ROW
+
+#else
+
+const CPU::DecodedInstruction* CPU::find_block(uint16_t address) {
+    const Cartridge* cart = bus->cart;
+    size_t offset = 0;
+    if (!cart || !cart->prg_rom_offset(address, offset)) {
+        return nullptr;
+    }
+
+    if (block_cartridge != cart || block_lookup.size() != cart->prg_rom_size()) {
+        block_cartridge = cart;
+        block_lookup.assign(cart->prg_rom_size(), -1);
+        block_records.clear();
+        if (jit) {
+            jit->flush();
         }
+    }
+
+    int32_t index = block_lookup[offset];
+    if (index == -1) {
+        index = decode_block(address, offset);
+    }
+    return index < 0 ? nullptr : &block_records[index];
+}
+
+// A block ends after any instruction that changes PC, at the end of the 8KB
+// window (the next bytes may belong to another bank) or after max_block_length
+// instructions. Illegal opcodes are left to the interpreter.
+int32_t CPU::decode_block(uint16_t address, size_t offset) {
+    const uint8_t* rom = block_cartridge->prg_rom();
+    const int32_t first = static_cast<int32_t>(block_records.size());
+    uint16_t window_left = 0x2000 - (address & 0x1FFF);
+    size_t cursor = offset;
+
+    for (uint8_t count = 0; count < max_block_length; count++) {
+        const uint8_t opcode = rom[cursor];
+        const Instruction& instruction = instruction_table[opcode];
+        const uint8_t length = 1 + operand_bytes(instruction.mode);
+        if (instruction.kind == Kind::ILLEGAL || length > window_left) {
             break;
-        case 0x71:
-            ADC(read(addr_ind_y(additional_cycles)));
-            break;
-        case 0x29:
-            AND(fetch());
-            break;
-        case 0x25:
-            AND(read(fetch()));
-            break;
-        case 0x35:
-            AND(read((fetch() + X)& 0xFF));
-            break;
-        case 0x2D:
-            AND(read(fetch16()));
-            break;
-        case 0x3D:
-            AND(read(addr_abs_x(additional_cycles)));
-            break;
-        case 0x39:
-            AND(read(addr_abs_y(additional_cycles)));
-            break;
-        case 0x21:
-        {
-            uint8_t base_addr = fetch();
-            uint16_t lookup_addr = (base_addr + X) & 0x00FF;
-            uint16_t effective_addr = read16_zeropage(lookup_addr);
-            AND(read(effective_addr));
         }
+
+        uint16_t operand = 0;
+        if (length > 1) {
+            operand = rom[cursor + 1];
+        }
+        if (length > 2) {
+            operand |= rom[cursor + 2] << 8;
+        }
+        block_records.push_back({instruction.execute, operand, opcode, length,
+                                 instruction.cycles, instruction.page_penalty, false, false});
+
+        cursor += length;
+        window_left -= length;
+        if (instruction.kind == Kind::BRANCH || instruction.kind == Kind::JUMP ||
+            opcode == 0x00 || opcode == 0x40 || opcode == 0x60 || window_left == 0) {
             break;
-        case 0x31:
-            AND(read(addr_ind_y(additional_cycles)));
-            break;
-        case 0x0A:
-            ASL_accumulator();
-            break;
-        case 0x06:
-            ASL(fetch());
-            break;
-        case 0x16:
-            ASL((fetch() + X)& 0xFF);
-            break;
-        case 0x0E:
-            ASL(fetch16());
-            break;
-        case 0x1E:
-            ASL(fetch16() + X);
-            break;
-        case 0x90:
-            offset = fetch();
-            if (!Getflag(FLAG_C)) {
-                additional_cycles=1;
-                uint16_t target_addr = PC + offset;
-                if ((PC & 0xFF00) != (target_addr & 0xFF00)) {
-                    additional_cycles++;
-                }
-                PC = target_addr;
-            }
-            break;
-        case 0xB0:
-            offset = fetch();
-            if (Getflag(FLAG_C)) {
-                additional_cycles=1;
-                uint16_t target_addr = PC + offset;
-                if ((PC & 0xFF00) != (target_addr & 0xFF00)) {
-                    additional_cycles++;
-                }
-                PC = target_addr;
-            }
-            break;
-        case 0xF0:
-            offset = fetch();
-            if (Getflag(FLAG_Z)) {
-                additional_cycles=1;
-                uint16_t target_addr = PC + offset;
-                if ((PC & 0xFF00) != (target_addr & 0xFF00)) {
-                    additional_cycles++;
-                }
-                PC = target_addr;
-            }
-            break;
-        case 0x24:
-            BIT(fetch());
-            break;
-        case 0x2C:
-            BIT(fetch16());
-            break;
-        case 0x30:
-            offset = fetch();
-            if (Getflag(FLAG_N)) {
-                additional_cycles=1;
-                uint16_t target_addr = PC + offset;
-                if ((PC & 0xFF00) != (target_addr & 0xFF00)) {
-                    additional_cycles++;
-                }
-                PC = target_addr;
+        }
+    }
+
+    if (block_records.size() == static_cast<size_t>(first)) {
+        block_lookup[offset] = -2;
+        return -2;
+    }
+    block_records.back().last = true;
+    block_records[first].idle_loop = is_idle_loop(&block_records[first], &block_records.back());
+    block_lookup[offset] = first;
+    return first;
+}
+
+// A polling loop: up to two reads of RAM or PPUSTATUS (optionally masked or
+// compared with an immediate) and a branch back to its start, or JMP to itself.
+// Repeating it changes nothing until the polled value does. PPUSTATUS loops
+// must spin while bit 7 is clear, as reading it with bit 7 set clears it.
+bool CPU::is_idle_loop(const DecodedInstruction* first, const DecodedInstruction* last) {
+    if (first == last) {
+        return last->opcode == 0x4C;
+    }
+    if (last - first > 2 || instruction_table[last->opcode].kind != Kind::BRANCH) {
+        return false;
+    }
+
+    int loop_length = last->length;
+    bool ppu_status = false;
+    uint8_t mask = 0xFF;
+    for (const DecodedInstruction* record = first; record != last; ++record) {
+        loop_length += record->length;
+        const Instruction& instruction = instruction_table[record->opcode];
+        if (instruction.mode == Mode::IMM) {
+            if (record->opcode == 0x29) {
+                mask &= static_cast<uint8_t>(record->operand);
+            } else if (record->opcode != 0xC9 && record->opcode != 0xE0 && record->opcode != 0xC0) {
+                return false;
             }
-            break;
-        case 0xD0:
-            offset = fetch();
-            if (!Getflag(FLAG_Z)) {
-                additional_cycles=1;
-                uint16_t target_addr = PC + offset;
-                if ((PC & 0xFF00) != (target_addr & 0xFF00)) {
-                    additional_cycles++;
-                }
-                PC = target_addr;
+            continue;
+        }
+        const bool load = record->opcode == 0xA5 || record->opcode == 0xAD || record->opcode == 0xA6 ||
+                          record->opcode == 0xAE || record->opcode == 0xA4 || record->opcode == 0xAC ||
+                          record->opcode == 0x24 || record->opcode == 0x2C;
+        if (!load) {
+            return false;
+        }
+        if ((record->operand & 0xE007) == 0x2002) {
+            ppu_status = true;
+        } else if (record->operand >= 0x2000) {
+            return false;
+        }
+    }
+
+    if (loop_length + static_cast<int8_t>(last->operand) != 0) {
+        return false;
+    }
+    if (ppu_status) {
+        // The branch has to depend on bit 7 alone and be taken while it is clear.
+        const bool compare = last - first == 2 && (first + 1)->opcode != 0x29;
+        return !compare && (last->opcode == 0x10 || (last->opcode == 0xF0 && mask == 0x80));
+    }
+    return true;
+}
+
+// Ticks the bus for as many whole iterations of the loop just executed as fit
+// before the next VBlank edge, frame start, pending NMI or scheduled event.
+// Every IRQ source is a scheduled event, so loops running with I clear that
+// wait for an IRQ handler are skipped too, up to the event that may raise it.
+int64_t CPU::skip_idle_loop(int64_t iteration_cycles, int64_t budget) {
+    if (iteration_cycles <= 0) {
+        return 0;
+    }
+    // Catching up may raise NMI or IRQ itself.
+    const uint64_t now = bus->get_timestamp();
+    bus->sync_ppu(now);
+    if (nmi_pending || (irq_inputs && !Getflag(FLAG_I))) {
+        return 0;
+    }
+
+    // Leave at least one real iteration before the event.
+    const uint64_t event = bus->next_event();
+    const int64_t event_dots = event <= now ? 0 : static_cast<int64_t>(std::min<uint64_t>(event - now, INT32_MAX));
+    const int64_t dots = std::min<int64_t>(bus->ppu.dots_until_vblank_event(), event_dots);
+    const int64_t horizon = dots / 3 - 2 * iteration_cycles;
+    const int64_t available = std::min(horizon, budget);
+    if (available < iteration_cycles) {
+        return 0;
+    }
+
+    const int64_t skipped = available - available % iteration_cycles;
+    int64_t elapsed = 0;
+    while (elapsed < skipped) {
+        bus->begin_cpu_cycle();
+        elapsed += bus->end_cpu_cycles(static_cast<uint8_t>(std::min<int64_t>(skipped - elapsed, 255)));
+    }
+    return elapsed;
+}
+
+int64_t CPU::run(int64_t cycles) {
+    int64_t elapsed = 0;
+    while (elapsed < cycles) {
+        bus->begin_cpu_cycle();
+        if (uint8_t interrupt_cycles = service_interrupts()) {
+            elapsed += bus->end_cpu_cycles(interrupt_cycles);
+            continue;
+        }
+
+        const DecodedInstruction* record = (tracer || sampler) ? nullptr : find_block(PC);
+        if (!record) {
+            if (tracer) {
+                trace_instruction();
             }
-            break;
-        case 0x10:
-            offset = fetch();
-            if (!Getflag(FLAG_N)) {
-                additional_cycles=1;
-                uint16_t target_addr = PC + offset;
-                if ((PC & 0xFF00) != (target_addr & 0xFF00)) {
-                    additional_cycles++;
-                }
-                PC = target_addr;
+            if (sampler) {
+                sampler->sample(PC);
             }
-            break;
-        case 0x00:
-            BRK();
-            break;
-        case 0x50:
-            offset = fetch();
-            if (!Getflag(FLAG_V)) {
-                additional_cycles=1;
-                uint16_t target_addr = PC + offset;
-                if ((PC & 0xFF00) != (target_addr & 0xFF00)) {
-                    additional_cycles++;
+            elapsed += bus->end_cpu_cycles(execute(fetch()));
+            continue;
+        }
+
+        const DecodedInstruction* block = record;
+        const uint16_t block_pc = PC;
+        const int64_t block_start = elapsed;
+        Jit::BlockCode code = jit ? jit->lookup(block) : nullptr;
+        if (code) {
+            elapsed = jit->run(code, elapsed, cycles);
+        } else {
+            const uint32_t generation = block_cartridge->get_prg_bank_generation();
+            for (;;) {
+                PC += record->length;
+                uint8_t additional_cycles = record->execute(*this, record->operand);
+                const uint8_t instruction_cycles = record->cycles + (record->page_penalty ? additional_cycles : 0);
+                profile_instruction(record->opcode, instruction_cycles);
+                elapsed += bus->end_cpu_cycles(instruction_cycles);
+                if (record->last || elapsed >= cycles ||
+                    block_cartridge->get_prg_bank_generation() != generation) {
+                    break;
                 }
-                PC = target_addr;
-            }
-            break;
-        case 0x70:
-            offset = fetch();
-            if (Getflag(FLAG_V)) {
-                additional_cycles=1;
-                uint16_t target_addr = PC + offset;
-                if ((PC & 0xFF00) != (target_addr & 0xFF00)) {
-                    additional_cycles++;
+
+                bus->begin_cpu_cycle();
+                if (uint8_t interrupt_cycles = service_interrupts()) {
+                    elapsed += bus->end_cpu_cycles(interrupt_cycles);
+                    break;
                 }
-                PC = target_addr;
+                ++record;
             }
-            break;
-        case 0x18:
-            CLC();
-            break;
-        case 0xD8:
-            CLD();
-            break;
-        case 0x58:
-            CLI();
-            break;
-        case 0xB8:
-            CLV();
-            break;
-        case 0xC9:
-            CMP(fetch());
-            break;
-        case 0xC5:
-            CMP(read(fetch()));
-            break;
-        case 0xD5:
-            CMP(read((fetch() + X) & 0xFF));
-            break;
-        case 0xCD:
-            CMP(read(fetch16()));
-            break;
-        case 0xDD:
-            CMP(read(addr_abs_x(additional_cycles)));
-            break;
-        case 0xD9:
-            CMP(read(addr_abs_y(additional_cycles)));
-            break;
-        case 0xC1:
-        {
-            uint8_t base_addr = fetch();
-            uint16_t lookup_addr = (base_addr + X) & 0x00FF;
-            uint16_t effective_addr = read16_zeropage(lookup_addr);
-            CMP(read(effective_addr));
-        }
-            break;
-        case 0xD1:
-            CMP(read(addr_ind_y(additional_cycles)));
-            break;
-        case 0xE0:
-            CPX(fetch());
-            break;
-        case 0xE4:
-            CPX(read(fetch()));
-            break;
-        case 0xEC:
-            CPX(read(fetch16()));
-            break;
-        case 0xC0:
-            CPY(fetch());
-            break;
-        case 0xC4:
-            CPY(read(fetch()));
-            break;
-        case 0xCC:
-            CPY(read(fetch16()));
-            break;
-        case 0xC6:
-            DEC(fetch());
-            break;
-        case 0xD6:
-            DEC((fetch() + X)& 0xFF);
-            break;
-        case 0xCE:
-            DEC(fetch16());
-            break;
-        case 0xDE:
-            DEC(fetch16() + X);
-            break;
-        case 0xCA:
-            DEX();
-            break;
-        case 0x88:
-            DEY();
-            break;
-        case 0x49:
-            EOR(fetch());
-            break;
-        case 0x45:
-            EOR(read(fetch()));
-            break;
-        case 0x55:
-            EOR(read((fetch() + X) & 0xFF ));
-            break;
-        case 0x4D:
-            EOR(read(fetch16()));
-            break;
-        case 0x5D:
-            EOR(read(addr_abs_x(additional_cycles)));
-            break;
-        case 0x59:
-            EOR(read(addr_abs_y(additional_cycles)));
-            break;
-        case 0x41:
-        {
-            uint8_t base_addr = fetch();
-            uint16_t lookup_addr = (base_addr + X) & 0x00FF;
-            uint16_t effective_addr = read16_zeropage(lookup_addr);
-            EOR(read(effective_addr));
-            break;
-        }
-        case 0x51:
-            EOR(read(addr_ind_y(additional_cycles)));
-            break;
-        case 0xE6:
-            INC(fetch());
-            break;
-        case 0xF6:
-            INC((fetch() + X)& 0xFF);
-            break;
-        case 0xEE:
-            INC(fetch16());
-            break;
-        case 0xFE:
-            INC(fetch16() + X);
-            break;
-        case 0xE8:
-            INX();
-            break;
-        case 0xC8:
-            INY();
-            break;
-        case 0x4C:
-            JMP(fetch16());
-            break;
-        case 0x6C:
-            JMP_indirect(fetch16());
-            break;
-        case 0x20:
-            JSR(fetch16());
-            break;
-        case 0xA9:
-            LDA(fetch() & 0xFF);
-            break;
-        case 0xA5:
-            LDA(read(fetch() & 0xFF));
-            break;
-        case 0xB5:
-            LDA(read((fetch() + X) & 0xFF));
-            break;
-        case 0xAD:
-            LDA(read(fetch16()));
-            break;
-        case 0xBD:
-            LDA(read(addr_abs_x(additional_cycles)));
-            break;
-        case 0xB9:
-            LDA(read(addr_abs_y(additional_cycles)));
-            break;
-        case 0xA1:{
-            uint8_t base_addr = fetch();
-            uint16_t lookup_addr = (base_addr + X) & 0x00FF;
-            uint16_t effective_addr = read16_zeropage(lookup_addr);
-            LDA(read(effective_addr));}
-            break;
-        case 0xB1:
-            LDA(read(addr_ind_y(additional_cycles)));
-            break;
-        case 0xA2:
-            LDX(fetch());
-            break;
-        case 0xA6:
-            LDX(read(fetch()));
-            break;
-        case 0xB6:
-            LDX(read((fetch() + Y) & 0xFF ));
-            break;
-        case 0xAE:
-            LDX(read(fetch16()));
-            break;
-        case 0xBE:
-            LDX(read(addr_abs_y(additional_cycles)));
-            break;
-        case 0xA0:
-            LDY(fetch());
-            break;
-        case 0xA4:
-            LDY(read(fetch()));
-            break;
-        case 0xB4:
-            LDY(read((fetch() + X) & 0xFF));
-            break;
-        case 0xAC:
-            LDY(read(fetch16()));
-            break;
-        case 0xBC:
-            LDY(read(addr_abs_x(additional_cycles)));
-            break;
-        case 0x4A:
-            LSR_accumulator();
-            break;
-        case 0x46:
-            LSR(fetch());
-            break;
-        case 0x56:
-            LSR((fetch() + X) & 0xFF);
-            break;
-        case 0x4E:
-            LSR(fetch16());
-            break;
-        case 0x5E:
-            LSR(fetch16() + X);
-            break;
-        case 0x09:
-            ORA(fetch());
-            break;
-        case 0x05:
-            ORA(read(fetch()));
-            break;
-        case 0x15:
-            ORA(read((fetch() + X) & 0xFF));
-            break;
-        case 0x0D:
-            ORA(read(fetch16()));
-            break;
-        case 0x1D:
-            ORA(read(addr_abs_x(additional_cycles)));
-            break;
-        case 0x19:
-            ORA(read(addr_abs_y(additional_cycles)));
-            break;
-        case 0x01:
-        {
-            uint8_t base_addr = fetch();
-            uint16_t lookup_addr = (base_addr + X) & 0x00FF;
-            uint16_t effective_addr = read16_zeropage(lookup_addr);
-            ORA(read(effective_addr));
         }
-            break;
-        case 0x11:
-            ORA(read(addr_ind_y(additional_cycles)));
-            break;
-        case 0x48:
-            PHA();
-            break;
-        case 0x08:
-            PHP();
-            break;
-        case 0x68:
-            PLA();
-            break;
-        case 0x28:
-            PLP();
-            break;
-        case 0x2A:
-            ROL_accumulator();
-            break;
-        case 0x26:
-            ROL(fetch());
-            break;
-        case 0x36:
-            ROL((fetch() + X) & 0xFF );
-            break;
-        case 0x2E:
-            ROL(fetch16());
-            break;
-        case 0x3E:
-            ROL(fetch16() + X);
-            break;
-        case 0x6A:
-            ROR_accumulator();
-            break;
-        case 0x66:
-            ROR(fetch());
-            break;
-        case 0x76:
-            ROR((fetch() + X) & 0xFF);
-            break;
-        case 0x6E:
-            ROR(fetch16());
-            break;
-        case 0x7E:
-            ROR(fetch16() + X);
-            break;
-        case 0x40:
-            RTI();
-            break;
-        case 0x60:
-            RTS();
-            break;
-        case 0xE9:
-            SBC(fetch());
-            break;
-        case 0xE5: SBC(read(fetch()));
-            break;
-        case 0xF5:
-            SBC(read((fetch() + X) & 0xFF ));
-            break;
-        case 0xED:
-            SBC(read(fetch16()));
-            break;
-        case 0xFD:
-            SBC(read(addr_abs_x(additional_cycles)));
-            break;
-        case 0xF9:
-            SBC(read(addr_abs_y(additional_cycles)));
-            break;
-        case 0xE1:
-        {
-            uint8_t base_addr = fetch();
-            uint16_t lookup_addr = (base_addr + X) & 0x00FF;
-            uint16_t effective_addr = read16_zeropage(lookup_addr);
-            SBC(read(effective_addr));
-        }
-            break;
-        case 0xF1:
-            SBC(read(addr_ind_y(additional_cycles)));
-            break;
-        case 0x38:
-            SEC();
-            break;
-        case 0xF8:
-            SED();
-            break;
-        case 0x78:
-            SEI();
-            break;
-        case 0x85:
-            STA(fetch()); break;
-        case 0x95:
-            STA((fetch() + X) & 0xFF);
-            break;
-        case 0x8D:
-            STA(fetch16());
-            break;
-        case 0x9D:
-            STA(fetch16() + X);
-            break;
-        case 0x99:
-            STA(fetch16() + Y);
-            break;
-        case 0x81:
-        {
-            uint8_t base_addr = fetch();
-            uint16_t lookup_addr = (base_addr + X) & 0x00FF;
-            uint16_t effective_addr = read16_zeropage(lookup_addr);
-            STA(effective_addr);
-        }
-            break;
-        case 0x91:
-        {
-            uint8_t zp_addr = fetch();
-            uint16_t base_addr = read16_zeropage(zp_addr);
-            uint16_t final_addr = base_addr + Y;
-            write(final_addr, A);
-            break;
+
+        // Only a completed iteration of the loop lands back on its first instruction.
+        if (idle_skip && block->idle_loop && PC == block_pc && elapsed < cycles) {
+            elapsed += skip_idle_loop(elapsed - block_start, cycles - elapsed);
         }
-        case 0x86:
-            STX(fetch());
-            break;
-        case 0x96:
-            STX((fetch() + Y) & 0xFF);
-            break;
-        case 0x8E:
-            STX(fetch16());
-            break;
-        case 0x84:
-            STY(fetch());
-            break;
-        case 0x94:
-            STY((fetch() + X) & 0xFF);
-            break;
-        case 0x8C:
-            STY(fetch16());
-            break;
-        case 0xAA:
-            TAX();
-            break;
-        case 0xA8:
-            TAY();
-            break;
-        case 0xBA:
-            TSX();
-            break;
-        case 0x8A:
-            TXA();
-            break;
-        case 0x9A:
-            TXS();
-            break;
-        case 0x98:
-            TYA();
-            break;
     }
-    
-    cycles_left = instruction_cycles + additional_cycles;
-    cycles_left--;
+    return elapsed;
 }
 
+#endif
+
+#endif // EMUNES_CYCLE_CPU
+
 void CPU::ADC(uint8_t operand) {
     uint16_t temp = A + operand + (Getflag(FLAG_C) ? 1 : 0);
     Setflag(FLAG_C, temp > 0xFF);
-    Setflag(FLAG_Z, (temp & 0xFF) == 0);
     Setflag(FLAG_V, (~(A ^ operand) & (A ^ temp) & 0x80) != 0);
-    Setflag(FLAG_N, (temp & 0x80) != 0);
+    set_nz(static_cast<uint8_t>(temp));
     A = temp & 0xFF;
 }
 
 void CPU::AND(uint8_t operand) {
     A &= operand;
-    Setflag(FLAG_Z, A == 0);
-    Setflag(FLAG_N, (A & 0x80) != 0);
-}
-
-void CPU::ASL_accumulator() {
-    Setflag(FLAG_C, (A & 0x80) != 0);
-    A <<= 1;
-    Setflag(FLAG_Z, A == 0);
-    Setflag(FLAG_N, (A & 0x80) != 0);
+    set_nz(A);
 }
 
-void CPU::ASL(uint16_t address) {
-    uint8_t value = read(address);
+uint8_t CPU::ASL(uint8_t value) {
     Setflag(FLAG_C, (value & 0x80) != 0);
     value <<= 1;
-    write(address, value);
-    Setflag(FLAG_Z, value == 0);
-    Setflag(FLAG_N, (value & 0x80) != 0);
-}
-
-void CPU::BCC(uint8_t offset) {
-    if (!Getflag(FLAG_C))
-        PC += static_cast<int8_t>(offset);
-}
-
-void CPU::BCS(uint8_t offset) {
-    if (Getflag(FLAG_C))
-        PC += static_cast<int8_t>(offset);
-}
-
-void CPU::BEQ(uint8_t offset) {
-    if (Getflag(FLAG_Z))
-        PC += static_cast<int8_t>(offset);
-}
-
-void CPU::BIT(uint16_t address) {
-    uint8_t value = read(address);
-    Setflag(FLAG_Z, (A & value) == 0);
-    Setflag(FLAG_N, (value & 0x80) != 0);
-    Setflag(FLAG_V, (value & 0x40) != 0);
-}
-
-void CPU::BMI(uint8_t offset) {
-    if (Getflag(FLAG_N))
-        PC += static_cast<int8_t>(offset);
-}
-
-void CPU::BNE(uint8_t offset) {
-    if (!Getflag(FLAG_Z))
-        PC += static_cast<int8_t>(offset);
+    set_nz(value);
+    return value;
 }
 
-void CPU::BPL(uint8_t offset) {
-    if (!Getflag(FLAG_N))
-        PC += static_cast<int8_t>(offset);
+void CPU::BIT(uint8_t operand) {
+    // N comes from the operand and Z from A & operand, so they are stored apart.
+    nz = static_cast<uint16_t>((operand << 8) | (A & operand));
+    Setflag(FLAG_V, (operand & 0x40) != 0);
 }
 
 void CPU::BRK() {
-    Setflag(FLAG_I, true);
+    const uint8_t return_sp = SP;
     stack_push16(++PC);
-    stack_push(status | FLAG_B | FLAG_Ig);
+    stack_push(pack_status() | FLAG_B | FLAG_Ig);
+    Setflag(FLAG_I, true);
     PC = read16(0xFFFE);
-}
-
-void CPU::BVC(uint8_t offset) {
-    if (!Getflag(FLAG_V))
-        PC += static_cast<int8_t>(offset);
-}
-
-void CPU::BVS(uint8_t offset) {
-    if (Getflag(FLAG_V))
-        PC += static_cast<int8_t>(offset);
+    if (sampler) {
+        sampler->enter(Sampler::Entry::BRK, PC, return_sp);
+    }
 }
 
 void CPU::CLC() {
@@ -843,122 +886,99 @@ void CPU::CLV() {
 void CPU::CMP(uint8_t operand) {
     uint16_t temp = (uint16_t)A - (uint16_t)operand;
     Setflag(FLAG_C, A >= operand);
-    Setflag(FLAG_Z, (temp & 0xFF) == 0);
-    Setflag(FLAG_N, (temp & 0x80) != 0);
+    set_nz(static_cast<uint8_t>(temp));
 }
 
 void CPU::CPX(uint8_t operand) {
     uint16_t temp = X - operand;
     Setflag(FLAG_C, X >= operand);
-    Setflag(FLAG_Z, (temp & 0xFF) == 0);
-    Setflag(FLAG_N, (temp & 0x80) != 0);
+    set_nz(static_cast<uint8_t>(temp));
 }
 
 void CPU::CPY(uint8_t operand) {
     uint16_t temp = Y - operand;
     Setflag(FLAG_C, Y >= operand);
-    Setflag(FLAG_Z, (temp & 0xFF) == 0);
-    Setflag(FLAG_N, (temp & 0x80) != 0);
+    set_nz(static_cast<uint8_t>(temp));
 }
 
-void CPU::DEC(uint16_t address) {
-    uint8_t value = read(address) - 1;
-    write(address, value);
-    Setflag(FLAG_Z, value == 0);
-    Setflag(FLAG_N, (value & 0x80) != 0);
+uint8_t CPU::DEC(uint8_t value) {
+    value--;
+    set_nz(value);
+    return value;
 }
 
 void CPU::DEX() {
     X--;
-    Setflag(FLAG_Z, X == 0);
-    Setflag(FLAG_N, (X & 0x80) != 0);
+    set_nz(X);
 }
 
 void CPU::DEY() {
     Y--;
-    Setflag(FLAG_Z, Y == 0);
-    Setflag(FLAG_N, (Y & 0x80) != 0);
+    set_nz(Y);
 }
 
 void CPU::EOR(uint8_t operand) {
     A ^= operand;
-    Setflag(FLAG_Z, A == 0);
-    Setflag(FLAG_N, (A & 0x80) != 0);
+    set_nz(A);
 }
 
-void CPU::INC(uint16_t address) {
-    uint8_t value = read(address) + 1;
-    write(address, value);
-    Setflag(FLAG_Z, value == 0);
-    Setflag(FLAG_N, (value & 0x80) != 0);
+uint8_t CPU::INC(uint8_t value) {
+    value++;
+    set_nz(value);
+    return value;
 }
 
 void CPU::INX() {
     X++;
-    Setflag(FLAG_Z, X == 0);
-    Setflag(FLAG_N, (X & 0x80) != 0);
+    set_nz(X);
 }
 
 void CPU::INY() {
     Y++;
-    Setflag(FLAG_Z, Y == 0);
-    Setflag(FLAG_N, (Y & 0x80) != 0);
+    set_nz(Y);
 }
 
 void CPU::JMP(uint16_t address) {
     PC = address;
 }
 
-void CPU::JMP_indirect(uint16_t address) {
-    uint16_t low = read(address);
-    uint16_t high_addr = (address & 0xFF00) | ((address + 1) & 0x00FF);
-    uint16_t high = read(high_addr);
-    PC = (high << 8) | low;
-}
-
 void CPU::JSR(uint16_t address) {
+    const uint8_t return_sp = SP;
     stack_push16(PC - 1);
     PC = address;
+    if (sampler) {
+        sampler->enter(Sampler::Entry::CALL, PC, return_sp);
+    }
 }
 
 void CPU::LDA(uint8_t operand) {
     A = operand;
-    Setflag(FLAG_Z, A == 0);
-    Setflag(FLAG_N, (A & 0x80) != 0);
+    set_nz(A);
 }
 
 void CPU::LDX(uint8_t operand) {
     X = operand;
-    Setflag(FLAG_Z, X == 0);
-    Setflag(FLAG_N, (X & 0x80) != 0);
+    set_nz(X);
 }
 
 void CPU::LDY(uint8_t operand) {
     Y = operand;
-    Setflag(FLAG_Z, Y == 0);
-    Setflag(FLAG_N, (Y & 0x80) != 0);
+    set_nz(Y);
 }
 
-void CPU::LSR_accumulator() {
-    Setflag(FLAG_C, (A & 0x01) != 0);
-    A >>= 1;
-    Setflag(FLAG_Z, A == 0);
-    Setflag(FLAG_N, (A & 0x80) != 0);
-}
-
-void CPU::LSR(uint16_t address) {
-    uint8_t value = read(address);
+uint8_t CPU::LSR(uint8_t value) {
     Setflag(FLAG_C, (value & 0x01) != 0);
     value >>= 1;
-    write(address, value);
-    Setflag(FLAG_Z, value == 0);
-    Setflag(FLAG_N, (value & 0x80) != 0);
+    set_nz(value);
+    return value;
+}
+
+void CPU::NOP() {
 }
 
 void CPU::ORA(uint8_t operand) {
     A |= operand;
-    Setflag(FLAG_Z, A == 0);
-    Setflag(FLAG_N, (A & 0x80) != 0);
+    set_nz(A);
 }
 
 void CPU::PHA() {
@@ -966,73 +986,55 @@ void CPU::PHA() {
 }
 
 void CPU::PHP() {
-    stack_push(status | FLAG_B | FLAG_Ig);
+    stack_push(pack_status() | FLAG_B | FLAG_Ig);
 }
 
 void CPU::PLA() {
     A = stack_pop();
-    Setflag(FLAG_Z, A == 0);
-    Setflag(FLAG_N, (A & 0x80) != 0);
+    set_nz(A);
 }
 
 void CPU::PLP() {
     uint8_t popped_status = stack_pop();
-    status = (popped_status & ~FLAG_B & ~FLAG_Ig) | (status & (FLAG_B | FLAG_Ig));
+    unpack_status((popped_status & ~FLAG_B & ~FLAG_Ig) | (status & (FLAG_B | FLAG_Ig)));
 }
 
-void CPU::ROL_accumulator() {
-    uint8_t carry = Getflag(FLAG_C) ? 1 : 0;
-    Setflag(FLAG_C, (A & 0x80) != 0);
-    A = (A << 1) | carry;
-    Setflag(FLAG_Z, A == 0);
-    Setflag(FLAG_N, (A & 0x80) != 0);
-}
-
-void CPU::ROL(uint16_t address) {
-    uint8_t value = read(address);
+uint8_t CPU::ROL(uint8_t value) {
     uint8_t carry = Getflag(FLAG_C) ? 1 : 0;
     Setflag(FLAG_C, (value & 0x80) != 0);
     value = (value << 1) | carry;
-    write(address, value);
-    Setflag(FLAG_Z, value == 0);
-    Setflag(FLAG_N, (value & 0x80) != 0);
-}
-
-void CPU::ROR_accumulator() {
-    uint8_t carry = Getflag(FLAG_C) ? 0x80 : 0;
-    Setflag(FLAG_C, (A & 0x01) != 0);
-    A = (A >> 1) | carry;
-    Setflag(FLAG_Z, A == 0);
-    Setflag(FLAG_N, (A & 0x80) != 0);
+    set_nz(value);
+    return value;
 }
 
-void CPU::ROR(uint16_t address) {
-    uint8_t value = read(address);
+uint8_t CPU::ROR(uint8_t value) {
     uint8_t carry = Getflag(FLAG_C) ? 0x80 : 0;
     Setflag(FLAG_C, (value & 0x01) != 0);
     value = (value >> 1) | carry;
-    write(address, value);
-    Setflag(FLAG_Z, value == 0);
-    Setflag(FLAG_N, (value & 0x80) != 0);
+    set_nz(value);
+    return value;
 }
 
 void CPU::RTI() {
-    status = stack_pop();
-    status &= ~FLAG_B;
-    status |=  FLAG_Ig;
+    unpack_status((stack_pop() & ~FLAG_B) | FLAG_Ig);
     PC = stack_pop16();
+    if (sampler) {
+        sampler->leave(SP);
+    }
 }
 
 void CPU::RTS() {
     PC = stack_pop16() + 1;
+    if (sampler) {
+        sampler->leave(SP);
+    }
 }
 
 void CPU::SBC(uint8_t operand) {
     uint16_t temp = A - operand - (Getflag(FLAG_C) ? 0 : 1);
     Setflag(FLAG_C, temp < 0x100);
-    Setflag(FLAG_Z, (temp & 0xFF) == 0);
     Setflag(FLAG_V, ((A ^ operand) & (A ^ temp) & 0x80) != 0);
-    Setflag(FLAG_N, (temp & 0x80) != 0);
+    set_nz(static_cast<uint8_t>(temp));
     A = temp & 0xFF;
 }
 
@@ -1048,40 +1050,24 @@ void CPU::SEI() {
     Setflag(FLAG_I, true);
 }
 
-void CPU::STA(uint16_t address) {
-    write(address, A);
-}
-
-void CPU::STX(uint16_t address) {
-    write(address, X);
-}
-
-void CPU::STY(uint16_t address) {
-    write(address, Y);
-}
-
 void CPU::TAX() {
     X = A;
-    Setflag(FLAG_Z, X == 0);
-    Setflag(FLAG_N, (X & 0x80) != 0);
+    set_nz(X);
 }
 
 void CPU::TAY() {
     Y = A;
-    Setflag(FLAG_Z, Y == 0);
-    Setflag(FLAG_N, (Y & 0x80) != 0);
+    set_nz(Y);
 }
 
 void CPU::TSX() {
     X = SP;
-    Setflag(FLAG_Z, X == 0);
-    Setflag(FLAG_N, (X & 0x80) != 0);
+    set_nz(X);
 }
 
 void CPU::TXA() {
     A = X;
-    Setflag(FLAG_Z, A == 0);
-    Setflag(FLAG_N, (A & 0x80) != 0);
+    set_nz(A);
 }
 
 void CPU::TXS() {
@@ -1090,12 +1076,11 @@ void CPU::TXS() {
 
 void CPU::TYA() {
     A = Y;
-    Setflag(FLAG_Z, A == 0);
-    Setflag(FLAG_N, (A & 0x80) != 0);
+    set_nz(A);
 }
 
 void CPU::stack_push(uint8_t value) {
-    write(0x0100 + SP, value);
+    bus->get_ram()[0x0100 + SP] = value;
     SP--;
 }
 
@@ -1105,7 +1090,7 @@ void CPU::stack_push16(uint16_t value) {
 }
 
 uint8_t CPU::stack_pop() {
-    uint8_t value = read(0x0100 + SP + 1);
+    uint8_t value = bus->get_ram()[0x0100 + SP + 1];
     SP++;
     return value;
 }
@@ -0,0 +1,420 @@
+#include <cstdint>
+#include <cpu.h>
+#include <bus.h>
+#include <trace.h>
+#include <sampler.h>
+
+#ifdef EMUNES_CYCLE_CPU
+
+// Cycle-stepped CPU core. Every call to clock() performs exactly one bus
+// access of the current instruction, including the dummy reads and writes of
+// the real 6502, so the PPU/APU observe reads and writes on the right cycle.
+// Interrupts are polled at the start of the last cycle of each instruction.
+
+void CPU::set_jit_enabled(bool) {
+}
+
+bool CPU::is_instruction_complete() {
+    return cycles_left == 0 && tcycle == 0;
+}
+
+void CPU::nmi(bool) {
+    // The NMI delay falls out of polling interrupts on the last cycle.
+    nmi_pending = true;
+}
+
+void CPU::clock() {
+    if (cycles_left > 0) {
+        cycles_left--;
+        return;
+    }
+
+    bool poll = nmi_pending || (irq_inputs != 0 && !Getflag(FLAG_I));
+
+    if (tcycle == 0) {
+        if (interrupt_ready) {
+            interrupt_ready = false;
+            in_interrupt = true;
+            opcode = 0x00;
+            read(PC);
+        } else {
+            if (tracer) {
+                trace_instruction();
+            }
+            if (sampler) {
+                sampler->sample(PC);
+            }
+            opcode = fetch();
+        }
+        tcycle = 1;
+        return;
+    }
+
+    const Instruction& instruction = instruction_table[opcode];
+    const bool interrupt = in_interrupt;
+    bool done = false;
+    switch (instruction.kind) {
+    case Kind::READ:
+    case Kind::MODIFY:
+    case Kind::STORE:
+        if (instruction.mode == Mode::IMM) {
+            instruction.operate(*this, fetch());
+            done = true;
+        } else if (instruction.mode == Mode::ACC) {
+            read(PC);
+            A = instruction.operate(*this, A);
+            done = true;
+        } else {
+            done = cycle_memory(instruction);
+        }
+        break;
+    case Kind::BRANCH:
+        done = cycle_branch(instruction, poll);
+        break;
+    default:
+        done = cycle_special(instruction);
+        break;
+    }
+
+    if (done) {
+        if (!interrupt) {
+            profile_instruction(opcode, tcycle + 1);
+        }
+        tcycle = 0;
+        interrupt_ready = poll;
+    } else {
+        tcycle++;
+    }
+}
+
+bool CPU::cycle_memory(const Instruction& instruction) {
+    // first is the cycle of the first operand access; indexed modes spend the
+    // cycle before it reading from the not yet carried address.
+    uint8_t first = 0;
+    bool indexed = false;
+
+    switch (instruction.mode) {
+    case Mode::ZP0:
+        if (tcycle == 1) {
+            address = fetch();
+            return false;
+        }
+        first = 2;
+        break;
+    case Mode::ZPX:
+    case Mode::ZPY:
+        if (tcycle == 1) {
+            address = fetch();
+            return false;
+        }
+        if (tcycle == 2) {
+            read(address);
+            address = (address + (instruction.mode == Mode::ZPX ? X : Y)) & 0x00FF;
+            return false;
+        }
+        first = 3;
+        break;
+    case Mode::ABS:
+        if (tcycle == 1) {
+            address = fetch();
+            return false;
+        }
+        if (tcycle == 2) {
+            address |= fetch() << 8;
+            return false;
+        }
+        first = 3;
+        break;
+    case Mode::ABX:
+    case Mode::ABY:
+        if (tcycle == 1) {
+            pointer = fetch();
+            return false;
+        }
+        if (tcycle == 2) {
+            pointer |= fetch() << 8;
+            address = pointer + (instruction.mode == Mode::ABX ? X : Y);
+            pointer = (pointer & 0xFF00) | (address & 0x00FF);
+            return false;
+        }
+        first = 4;
+        indexed = true;
+        break;
+    case Mode::IZX:
+        if (tcycle == 1) {
+            pointer = fetch();
+            return false;
+        }
+        if (tcycle == 2) {
+            read(pointer);
+            pointer = (pointer + X) & 0x00FF;
+            return false;
+        }
+        if (tcycle == 3) {
+            address = read(pointer);
+            return false;
+        }
+        if (tcycle == 4) {
+            address |= read((pointer + 1) & 0x00FF) << 8;
+            return false;
+        }
+        first = 5;
+        break;
+    case Mode::IZY:
+        if (tcycle == 1) {
+            pointer = fetch();
+            return false;
+        }
+        if (tcycle == 2) {
+            address = read(pointer);
+            return false;
+        }
+        if (tcycle == 3) {
+            address |= read((pointer + 1) & 0x00FF) << 8;
+            pointer = (address & 0xFF00) | ((address + Y) & 0x00FF);
+            address += Y;
+            return false;
+        }
+        first = 5;
+        indexed = true;
+        break;
+    default:
+        return true;
+    }
+
+    if (indexed && tcycle == first - 1) {
+        if (instruction.kind == Kind::READ && pointer == address) {
+            return cycle_access(instruction, 0);
+        }
+        read(pointer);
+        return false;
+    }
+    return cycle_access(instruction, tcycle - first);
+}
+
+bool CPU::cycle_access(const Instruction& instruction, uint8_t access_cycle) {
+    switch (instruction.kind) {
+    case Kind::READ:
+        instruction.operate(*this, read(address));
+        return true;
+    case Kind::STORE:
+        write(address, instruction.operate(*this, 0));
+        return true;
+    case Kind::MODIFY:
+        if (access_cycle == 0) {
+            data = read(address);
+            return false;
+        }
+        if (access_cycle == 1) {
+            write(address, data);
+            data = instruction.operate(*this, data);
+            return false;
+        }
+        write(address, data);
+        return true;
+    default:
+        return true;
+    }
+}
+
+bool CPU::cycle_branch(const Instruction& instruction, bool& poll) {
+    if (tcycle == 1) {
+        data = fetch();
+        branch_poll = poll;
+        return instruction.operate(*this, data) == 0;
+    }
+    if (tcycle == 2) {
+        read(PC);
+        address = PC + static_cast<int8_t>(data);
+        PC = (PC & 0xFF00) | (address & 0x00FF);
+        if (PC == address) {
+            // A taken branch without page cross does not poll in its last cycle.
+            poll = branch_poll;
+            return true;
+        }
+        return false;
+    }
+    read(PC);
+    PC = address;
+    return true;
+}
+
+bool CPU::cycle_special(const Instruction& instruction) {
+    switch (opcode) {
+    case 0x00: // BRK, IRQ, NMI
+        switch (tcycle) {
+        case 1:
+            if (in_interrupt) {
+                read(PC);
+            } else {
+                fetch();
+            }
+            return false;
+        case 2:
+            stack_push(PC >> 8);
+            return false;
+        case 3:
+            stack_push(PC & 0x00FF);
+            return false;
+        case 4:
+            // An NMI that arrived before this cycle hijacks the BRK/IRQ vector.
+            stack_push(in_interrupt ? ((pack_status() & ~FLAG_B) | FLAG_Ig) : (pack_status() | FLAG_B | FLAG_Ig));
+            Setflag(FLAG_I, true);
+            if (nmi_pending) {
+                nmi_pending = false;
+                pointer = 0xFFFA;
+            } else {
+                pointer = 0xFFFE;
+            }
+            return false;
+        case 5:
+            address = read(pointer);
+            return false;
+        default:
+            PC = (read(pointer + 1) << 8) | address;
+            if (nmi_log && in_interrupt && pointer == 0xFFFA) {
+                nmi_log->push_back(get_state());
+            }
+            if (sampler) {
+                const Sampler::Entry entry = !in_interrupt ? Sampler::Entry::BRK :
+                    (pointer == 0xFFFA ? Sampler::Entry::NMI : Sampler::Entry::IRQ);
+                sampler->enter(entry, PC, static_cast<uint8_t>(SP + 3));
+            }
+            in_interrupt = false;
+            return true;
+        }
+    case 0x20: // JSR
+        switch (tcycle) {
+        case 1:
+            address = fetch();
+            return false;
+        case 2:
+            read(0x0100 + SP);
+            return false;
+        case 3:
+            stack_push(PC >> 8);
+            return false;
+        case 4:
+            stack_push(PC & 0x00FF);
+            return false;
+        default:
+            PC = (read(PC) << 8) | address;
+            if (sampler) {
+                sampler->enter(Sampler::Entry::CALL, PC, static_cast<uint8_t>(SP + 2));
+            }
+            return true;
+        }
+    case 0x40: // RTI
+        switch (tcycle) {
+        case 1:
+            read(PC);
+            return false;
+        case 2:
+            read(0x0100 + SP);
+            return false;
+        case 3:
+            unpack_status((stack_pop() & ~FLAG_B) | FLAG_Ig);
+            return false;
+        case 4:
+            address = stack_pop();
+            return false;
+        default:
+            PC = (stack_pop() << 8) | address;
+            if (sampler) {
+                sampler->leave(SP);
+            }
+            return true;
+        }
+    case 0x60: // RTS
+        switch (tcycle) {
+        case 1:
+            read(PC);
+            return false;
+        case 2:
+            read(0x0100 + SP);
+            return false;
+        case 3:
+            address = stack_pop();
+            return false;
+        case 4:
+            PC = (stack_pop() << 8) | address;
+            if (sampler) {
+                sampler->leave(SP);
+            }
+            return false;
+        default:
+            fetch();
+            return true;
+        }
+    case 0x48: // PHA
+    case 0x08: // PHP
+        if (tcycle == 1) {
+            read(PC);
+            return false;
+        }
+        instruction.operate(*this, 0);
+        return true;
+    case 0x68: // PLA
+    case 0x28: // PLP
+        if (tcycle == 1) {
+            read(PC);
+            return false;
+        }
+        if (tcycle == 2) {
+            read(0x0100 + SP);
+            return false;
+        }
+        instruction.operate(*this, 0);
+        return true;
+    case 0x4C: // JMP abs
+        if (tcycle == 1) {
+            address = fetch();
+            return false;
+        }
+        PC = (fetch() << 8) | address;
+        return true;
+    case 0x6C: // JMP ind
+        switch (tcycle) {
+        case 1:
+            pointer = fetch();
+            return false;
+        case 2:
+            pointer |= fetch() << 8;
+            return false;
+        case 3:
+            address = read(pointer);
+            return false;
+        default:
+            PC = (read((pointer & 0xFF00) | ((pointer + 1) & 0x00FF)) << 8) | address;
+            return true;
+        }
+    default:
+        // Simple one-byte instructions; illegal opcodes run as one-byte NOPs,
+        // two cycles like in the instruction core.
+        read(PC);
+        instruction.operate(*this, 0);
+        return true;
+    }
+}
+
+uint8_t CPU::step() {
+    uint8_t cycles = 0;
+    do {
+        bus->begin_cpu_cycle();
+        clock();
+        cycles += bus->end_cpu_cycles(1);
+    } while (!is_instruction_complete());
+    return cycles;
+}
+
+int64_t CPU::run(int64_t cycles) {
+    int64_t elapsed = 0;
+    while (elapsed < cycles) {
+        bus->begin_cpu_cycle();
+        clock();
+        elapsed += bus->end_cpu_cycles(1);
+    }
+    return elapsed;
+}
+
+#endif // EMUNES_CYCLE_CPU
@@ -0,0 +1,296 @@
+#include <jit.h>
+#include <bus.h>
+
+#include <cstring>
+
+#ifdef EMUNES_JIT_SUPPORTED
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+Jit::Jit(CPU& cpu) : cpu(cpu) {
+#ifdef EMUNES_JIT_SUPPORTED
+    void* memory = mmap(nullptr, code_buffer_size, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory != MAP_FAILED) {
+        code_buffer = static_cast<uint8_t*>(memory);
+    }
+#endif
+}
+
+Jit::~Jit() {
+#ifdef EMUNES_JIT_SUPPORTED
+    if (code_buffer) {
+        munmap(code_buffer, code_buffer_size);
+    }
+#endif
+}
+
+#ifndef EMUNES_CYCLE_CPU
+
+namespace {
+
+// The code buffer is never writable and executable at once: the pages a
+// block goes into are made writable to copy it in and executable after.
+bool protect(uint8_t* begin, size_t length, bool writable) {
+#ifdef EMUNES_JIT_SUPPORTED
+    const uintptr_t page = static_cast<uintptr_t>(sysconf(_SC_PAGESIZE));
+    const uintptr_t start = reinterpret_cast<uintptr_t>(begin) & ~(page - 1);
+    const uintptr_t end = reinterpret_cast<uintptr_t>(begin) + length;
+    return mprotect(reinterpret_cast<void*>(start), end - start,
+                    writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+#else
+    (void)begin;
+    (void)length;
+    (void)writable;
+    return false;
+#endif
+}
+
+// Minimal x86-64 encoder for the handful of instructions the JIT emits.
+// rbx holds the CPU*, r12 the Jit*; everything else is scratch.
+class Emitter {
+public:
+    std::vector<uint8_t> code;
+
+    void bytes(std::initializer_list<uint8_t> values) {
+        code.insert(code.end(), values);
+    }
+    void u16(uint16_t value) {
+        bytes({static_cast<uint8_t>(value), static_cast<uint8_t>(value >> 8)});
+    }
+    void u32(uint32_t value) {
+        for (int i = 0; i < 4; i++) {
+            code.push_back(static_cast<uint8_t>(value >> (i * 8)));
+        }
+    }
+    void u64(uint64_t value) {
+        for (int i = 0; i < 8; i++) {
+            code.push_back(static_cast<uint8_t>(value >> (i * 8)));
+        }
+    }
+
+    // mov al, [rbx + field]
+    void load_al(uint32_t field) { bytes({0x8A, 0x83}); u32(field); }
+    // mov [rbx + field], al
+    void store_al(uint32_t field) { bytes({0x88, 0x83}); u32(field); }
+    // mov al, imm8
+    void mov_al(uint8_t value) { bytes({0xB0, value}); }
+    // mov rdx, imm64
+    void mov_rdx(const void* pointer) { bytes({0x48, 0xBA}); u64(reinterpret_cast<uint64_t>(pointer)); }
+    // mov al, [rdx] / mov [rdx], al
+    void load_al_rdx() { bytes({0x8A, 0x02}); }
+    void store_al_rdx() { bytes({0x88, 0x02}); }
+    // or/and byte [rbx + field], imm8
+    void or_field(uint32_t field, uint8_t value) { bytes({0x80, 0x8B}); u32(field); code.push_back(value); }
+    void and_field(uint32_t field, uint8_t value) { bytes({0x80, 0xA3}); u32(field); code.push_back(value); }
+    // add word [rbx + field], imm16
+    void add_word_field(uint32_t field, uint16_t value) { bytes({0x66, 0x81, 0x83}); u32(field); u16(value); }
+
+    // Stores al as the lazy N/Z result (CPU::set_nz).
+    void set_nz(uint32_t nz) {
+        bytes({0x88, 0xC4});                // mov ah, al
+        bytes({0x66, 0x89, 0x83}); u32(nz); // mov [rbx + nz], ax
+    }
+
+    // mov rax, imm64; call rax
+    void call(const void* function) {
+        bytes({0x48, 0xB8}); u64(reinterpret_cast<uint64_t>(function));
+        bytes({0xFF, 0xD0});
+    }
+};
+
+template <typename T>
+uint32_t field_offset(const CPU& cpu, const T& field) {
+    return static_cast<uint32_t>(reinterpret_cast<const char*>(&field) - reinterpret_cast<const char*>(&cpu));
+}
+
+} // namespace
+
+void Jit::flush() {
+    code_used = 0;
+    heat.clear();
+    blocks.clear();
+}
+
+Jit::BlockCode Jit::lookup(const CPU::DecodedInstruction* block) {
+    const size_t index = static_cast<size_t>(block - cpu.block_records.data());
+    if (index >= blocks.size()) {
+        heat.resize(cpu.block_records.size(), 0);
+        blocks.resize(cpu.block_records.size(), nullptr);
+    }
+    if (!blocks[index] && ++heat[index] == hot_threshold) {
+        blocks[index] = compile(block);
+    }
+    return blocks[index];
+}
+
+int64_t Jit::run(BlockCode code, int64_t elapsed_before, int64_t cycles) {
+    elapsed = elapsed_before;
+    budget = cycles;
+    generation = cpu.block_cartridge->get_prg_bank_generation();
+    code(&cpu, this);
+    return elapsed;
+}
+
+// Same bookkeeping as the interpreter loop in CPU::run between two records.
+uint8_t Jit::next_instruction(Jit* jit, uint32_t cycles) {
+    CPU& cpu = jit->cpu;
+    jit->elapsed += cpu.bus->end_cpu_cycles(static_cast<uint8_t>(cycles));
+    if (jit->elapsed >= jit->budget ||
+        cpu.block_cartridge->get_prg_bank_generation() != jit->generation) {
+        return 1;
+    }
+
+    cpu.bus->begin_cpu_cycle();
+    if (uint8_t interrupt_cycles = cpu.service_interrupts()) {
+        jit->elapsed += cpu.bus->end_cpu_cycles(interrupt_cycles);
+        return 1;
+    }
+    return 0;
+}
+
+void Jit::last_instruction(Jit* jit, uint32_t cycles) {
+    jit->elapsed += jit->cpu.bus->end_cpu_cycles(static_cast<uint8_t>(cycles));
+}
+
+Jit::BlockCode Jit::compile(const CPU::DecodedInstruction* block) {
+    const uint32_t pc = field_offset(cpu, cpu.PC);
+    const uint32_t status = field_offset(cpu, cpu.status);
+    const uint32_t nz = field_offset(cpu, cpu.nz);
+    const uint32_t sp = field_offset(cpu, cpu.SP);
+    const uint32_t a = field_offset(cpu, cpu.A);
+    const uint32_t x = field_offset(cpu, cpu.X);
+    const uint32_t y = field_offset(cpu, cpu.Y);
+    uint8_t* ram = cpu.bus->get_ram();
+
+    Emitter e;
+    std::vector<size_t> exits;
+
+    e.bytes({0x53});                    // push rbx
+    e.bytes({0x41, 0x54});              // push r12
+    e.bytes({0x48, 0x83, 0xEC, 0x08});  // sub rsp, 8
+    e.bytes({0x48, 0x89, 0xFB});        // mov rbx, rdi
+    e.bytes({0x49, 0x89, 0xF4});        // mov r12, rsi
+
+    for (const CPU::DecodedInstruction* record = block;; ++record) {
+        e.add_word_field(pc, record->length);
+
+        const uint16_t operand = record->operand;
+        const bool ram_operand = operand < 0x2000;
+        uint32_t reg = 0;
+        bool inline_op = true;
+        switch (record->opcode) {
+        case 0xA9: case 0xA2: case 0xA0: // LDA/LDX/LDY #imm
+            reg = record->opcode == 0xA9 ? a : (record->opcode == 0xA2 ? x : y);
+            e.mov_al(static_cast<uint8_t>(operand));
+            e.store_al(reg);
+            e.set_nz(nz);
+            break;
+        case 0xA5: case 0xA6: case 0xA4: // LDA/LDX/LDY zp
+        case 0xAD: case 0xAE: case 0xAC: // LDA/LDX/LDY abs
+            if (!ram_operand) {
+                inline_op = false;
+                break;
+            }
+            reg = (record->opcode & 0x03) == 0x01 ? a : ((record->opcode & 0x03) == 0x02 ? x : y);
+            e.mov_rdx(ram + (operand & 0x07FF));
+            e.load_al_rdx();
+            e.store_al(reg);
+            e.set_nz(nz);
+            break;
+        case 0x85: case 0x86: case 0x84: // STA/STX/STY zp
+        case 0x8D: case 0x8E: case 0x8C: // STA/STX/STY abs
+            if (!ram_operand) {
+                inline_op = false;
+                break;
+            }
+            reg = (record->opcode & 0x03) == 0x01 ? a : ((record->opcode & 0x03) == 0x02 ? x : y);
+            e.load_al(reg);
+            e.mov_rdx(ram + (operand & 0x07FF));
+            e.store_al_rdx();
+            break;
+        case 0x29: case 0x09: case 0x49: // AND/ORA/EOR #imm
+            e.load_al(a);
+            e.bytes({static_cast<uint8_t>(record->opcode == 0x29 ? 0x24 : (record->opcode == 0x09 ? 0x0C : 0x34)),
+                     static_cast<uint8_t>(operand)});
+            e.store_al(a);
+            e.set_nz(nz);
+            break;
+        case 0xAA: e.load_al(a); e.store_al(x); e.set_nz(nz); break; // TAX
+        case 0xA8: e.load_al(a); e.store_al(y); e.set_nz(nz); break; // TAY
+        case 0x8A: e.load_al(x); e.store_al(a); e.set_nz(nz); break; // TXA
+        case 0x98: e.load_al(y); e.store_al(a); e.set_nz(nz); break; // TYA
+        case 0xBA: e.load_al(sp); e.store_al(x); e.set_nz(nz); break; // TSX
+        case 0x9A: e.load_al(x); e.store_al(sp); break; // TXS
+        case 0xE8: case 0xC8: case 0xCA: case 0x88: // INX/INY/DEX/DEY
+            reg = (record->opcode == 0xE8 || record->opcode == 0xCA) ? x : y;
+            e.load_al(reg);
+            e.bytes({0xFE, static_cast<uint8_t>(record->opcode == 0xE8 || record->opcode == 0xC8 ? 0xC0 : 0xC8)});
+            e.store_al(reg);
+            e.set_nz(nz);
+            break;
+        case 0x18: e.and_field(status, static_cast<uint8_t>(~FLAG_C)); break; // CLC
+        case 0x38: e.or_field(status, FLAG_C); break;                         // SEC
+        case 0x58: e.and_field(status, static_cast<uint8_t>(~FLAG_I)); break; // CLI
+        case 0x78: e.or_field(status, FLAG_I); break;                         // SEI
+        case 0xD8: e.and_field(status, static_cast<uint8_t>(~FLAG_D)); break; // CLD
+        case 0xF8: e.or_field(status, FLAG_D); break;                         // SED
+        case 0xB8: e.and_field(status, static_cast<uint8_t>(~FLAG_V)); break; // CLV
+        case 0xEA: break;                                                     // NOP
+        default:
+            inline_op = false;
+            break;
+        }
+
+        if (!inline_op) {
+            e.bytes({0x48, 0x89, 0xDF});    // mov rdi, rbx
+            e.bytes({0xBE}); e.u32(operand); // mov esi, operand
+            e.call(reinterpret_cast<const void*>(record->execute));
+        }
+
+        e.bytes({0x4C, 0x89, 0xE7});        // mov rdi, r12
+        e.bytes({0xBE}); e.u32(record->cycles); // mov esi, cycles
+        if (!inline_op && record->page_penalty) {
+            e.bytes({0x0F, 0xB6, 0xC0});    // movzx eax, al
+            e.bytes({0x01, 0xC6});          // add esi, eax
+        }
+
+        if (record->last) {
+            e.call(reinterpret_cast<const void*>(&Jit::last_instruction));
+            break;
+        }
+        e.call(reinterpret_cast<const void*>(&Jit::next_instruction));
+        e.bytes({0x84, 0xC0});              // test al, al
+        e.bytes({0x0F, 0x85});              // jnz exit
+        exits.push_back(e.code.size());
+        e.u32(0);
+    }
+
+    const size_t exit = e.code.size();
+    e.bytes({0x48, 0x83, 0xC4, 0x08});  // add rsp, 8
+    e.bytes({0x41, 0x5C});              // pop r12
+    e.bytes({0x5B});                    // pop rbx
+    e.bytes({0xC3});                    // ret
+
+    for (size_t position : exits) {
+        const uint32_t relative = static_cast<uint32_t>(exit - (position + 4));
+        std::memcpy(&e.code[position], &relative, sizeof(relative));
+    }
+
+    if (code_used + e.code.size() > code_buffer_size) {
+        return nullptr;
+    }
+    uint8_t* target = code_buffer + code_used;
+    if (!protect(target, e.code.size(), true)) {
+        return nullptr;
+    }
+    std::memcpy(target, e.code.data(), e.code.size());
+    if (!protect(target, e.code.size(), false)) {
+        return nullptr;
+    }
+    code_used += (e.code.size() + 15) & ~static_cast<size_t>(15);
+    return reinterpret_cast<BlockCode>(target);
+}
+
+#endif // EMUNES_CYCLE_CPU
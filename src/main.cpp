@@ -1,5 +1,10 @@
+#include <cctype>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
 #include <iostream>
 #include <string>
+#include <vector>
 #if __has_include(<SDL2/SDL.h>)
 #include <SDL2/SDL.h>
 #elif __has_include(<SDL.h>)
@@ -9,32 +14,104 @@
 #endif
 #include "bus.h"
 #include "cartridge.h"
+#include "sampler.h"
+#include "trace.h"
 
 Bus bus;
 
 int main(int argc, char* argv[]) {
     bool test_mode = false;
+    bool use_jit = false;
+    std::string trace_path;
+    std::string profile_path;
+    std::string flamegraph_path;
+    uint32_t sample_period = 1;
     std::string rom_path = "/Users/kiramsabirzanov/projects/emuNES/zelda.nes";
-    if (argc > 1 && std::string(argv[1]) == "--test") {
-        test_mode = true;
-        if (argc > 2) {
-            rom_path = argv[2];
+    auto print_usage = [&]() {
+        std::cerr << "usage: " << argv[0]
+                  << " [--test] [--jit] [--trace <file>] [--profile <file.csv|file.json>]"
+                     " [--flamegraph <file>] [--sample-period <cycles>] [rom.nes]"
+                  << std::endl;
+    };
+    for (int i = 1; i < argc; ++i) {
+        const std::string arg = argv[i];
+        if (arg == "--test") {
+            test_mode = true;
+        } else if (arg == "--jit") {
+            use_jit = true;
+        } else if (arg == "--trace" && i + 1 < argc) {
+            trace_path = argv[++i];
+        } else if (arg == "--profile" && i + 1 < argc) {
+            profile_path = argv[++i];
+        } else if (arg == "--flamegraph" && i + 1 < argc) {
+            flamegraph_path = argv[++i];
+        } else if (arg == "--sample-period" && i + 1 < argc) {
+            const std::string value = argv[++i];
+            char* end = nullptr;
+            errno = 0;
+            const unsigned long period = std::strtoul(value.c_str(), &end, 10);
+            if (!std::isdigit(static_cast<unsigned char>(value[0])) || *end != '\0' || errno == ERANGE ||
+                period == 0 || period > UINT32_MAX) {
+                std::cerr << "Invalid sample period " << value << std::endl;
+                print_usage();
+                return -1;
+            }
+            sample_period = static_cast<uint32_t>(period);
+        } else if (arg.compare(0, 2, "--") == 0) {
+            std::cerr << "Unknown option or missing value " << arg << std::endl;
+            print_usage();
+            return -1;
+        } else {
+            rom_path = arg;
         }
-    } else if (argc > 1) {
-        rom_path = argv[1];
     }
 
     Cartridge cart(rom_path);
 
     bus.insert_cartridge(&cart);
+    bus.cpu.set_jit_enabled(use_jit);
     bus.cpu.reset();
     bus.ppu.reset();
     bus.apu.reset();
 
+    Tracer tracer(1 << 16);
+    if (!trace_path.empty()) {
+        if (!tracer.open(trace_path)) {
+            std::cerr << "Could not open trace file " << trace_path << std::endl;
+            return -1;
+        }
+        bus.cpu.set_tracer(&tracer);
+    }
+
+    Sampler sampler(bus, sample_period);
+    if (!flamegraph_path.empty()) {
+        bus.cpu.set_sampler(&sampler);
+    }
+
+    // --profile writes CSV, or JSON when the file name ends in .json.
+    auto write_reports = [&]() {
+        if (!flamegraph_path.empty() && !sampler.write_folded(flamegraph_path)) {
+            std::cerr << "Could not write flamegraph stacks " << flamegraph_path << std::endl;
+        }
+        if (profile_path.empty()) {
+            return;
+        }
+#ifdef EMUNES_PROFILE
+        const CpuProfile& profile = bus.cpu.get_profile();
+        const bool json = profile_path.size() >= 5 &&
+                          profile_path.compare(profile_path.size() - 5, 5, ".json") == 0;
+        if (!(json ? profile.write_json(profile_path) : profile.write_csv(profile_path))) {
+            std::cerr << "Could not write profile " << profile_path << std::endl;
+        }
+#else
+        std::cerr << "--profile needs a build with EMUNES_PROFILE=ON" << std::endl;
+#endif
+    };
+
     if (test_mode) {
         auto step_frame = [&]() {
             while (!bus.ppu.frame_complete) {
-                bus.clock();
+                bus.run_until(bus.get_timestamp() + 341);
             }
             bus.ppu.frame_complete = false;
         };
@@ -91,6 +168,7 @@ int main(int argc, char* argv[]) {
         if (!text.empty()) {
             std::cout << "[TEST] text:\n" << text << std::endl;
         }
+        write_reports();
         if (!signature_seen) {
             return 2;
         }
@@ -116,6 +194,8 @@ int main(int argc, char* argv[]) {
         return -1;
     }
     SDL_PauseAudioDevice(audio_device, 0);
+    std::vector<float> samples;
+    bus.apu.set_sample_log(&samples);
 
     SDL_Window* window = SDL_CreateWindow("emuNES", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 256 * 4, 240 * 4, SDL_WINDOW_SHOWN);
     SDL_Renderer* renderer = SDL_CreateRenderer(window, -1, SDL_RENDERER_ACCELERATED);
@@ -166,17 +246,15 @@ int main(int argc, char* argv[]) {
             continue;
         }
         while (!bus.ppu.frame_complete) {
-            bus.clock();
-
-            if (bus.apu.sample_ready) {
-                bus.apu.sample_ready = false;
-                float sample = bus.apu.output_sample;
-                SDL_QueueAudio(audio_device, &sample, sizeof(float));
-            }
+            bus.run_until(bus.get_timestamp() + 341);
         }
-
         bus.ppu.frame_complete = false;
 
+        if (!samples.empty()) {
+            SDL_QueueAudio(audio_device, samples.data(), static_cast<uint32_t>(samples.size() * sizeof(float)));
+            samples.clear();
+        }
+
         SDL_UpdateTexture(texture, nullptr, bus.ppu.get_screen(), 256 * sizeof(uint32_t));
         SDL_RenderClear(renderer);
         SDL_RenderCopy(renderer, texture, nullptr, nullptr);
@@ -195,5 +273,6 @@ int main(int argc, char* argv[]) {
     SDL_DestroyWindow(window);
     SDL_Quit();
 
+    write_reports();
     return 0;
 }
@@ -0,0 +1,259 @@
+#include "mapper.h"
+
+#include <algorithm>
+
+std::unique_ptr<Mapper> Mapper::create(uint8_t id, Cartridge& cartridge) {
+    std::unique_ptr<Mapper> mapper;
+    switch (id) {
+    case 0:
+        mapper.reset(new NromMapper(cartridge));
+        break;
+    case 1:
+        mapper.reset(new Mmc1Mapper(cartridge));
+        break;
+    case 2:
+        mapper.reset(new UxromMapper(cartridge));
+        break;
+    case 3:
+        mapper.reset(new CnromMapper(cartridge));
+        break;
+    case 4:
+        mapper.reset(new Mmc3Mapper(cartridge));
+        break;
+    default:
+        return nullptr;
+    }
+    mapper->update_banks();
+    return mapper;
+}
+
+void Mapper::map_prg(uint16_t address, size_t bank, size_t size) {
+    const size_t rom_size = cart.prg_memory.size();
+    const size_t first = ((address - 0x8000) >> 13) & 0x03;
+    for (size_t i = 0; i < size / 0x2000; i++) {
+        prg_slots[(first + i) & 0x03] = rom_size == 0 ? 0 : (bank * size + i * 0x2000) % rom_size;
+    }
+}
+
+void Mapper::map_chr(uint16_t address, size_t bank, size_t size) {
+    std::vector<uint8_t>& chr = cart.chr_memory;
+    const size_t first = (address >> 10) & 0x07;
+    for (size_t i = 0; i < size / 0x0400; i++) {
+        const size_t offset = (bank * size + i * 0x0400) % chr.size();
+        chr_slots[(first + i) & 0x07] = chr.data() + offset;
+        chr_row_slots[(first + i) & 0x07] = cart.chr_rows.data() + offset;
+    }
+}
+
+size_t Mapper::prg_bank_count(size_t size) const {
+    return std::max<size_t>(1, cart.prg_memory.size() / size);
+}
+
+size_t Mapper::chr_bank_count(size_t size) const {
+    return std::max<size_t>(1, cart.chr_memory.size() / size);
+}
+
+void NromMapper::update_banks() {
+    if (has_one_prg_bank()) {
+        map_prg(0x8000, 0, 0x4000);
+        map_prg(0xC000, 0, 0x4000);
+    } else {
+        map_prg(0x8000, 0, 0x8000);
+    }
+    map_chr(0x0000, 0, 0x2000);
+}
+
+void Mmc1Mapper::update_mirroring() {
+    switch (control & 0x03) {
+    case 0:
+        set_mirroring(Cartridge::ONESCREEN_LO);
+        break;
+    case 1:
+        set_mirroring(Cartridge::ONESCREEN_HI);
+        break;
+    case 2:
+        set_mirroring(Cartridge::VERTICAL);
+        break;
+    case 3:
+    default:
+        set_mirroring(Cartridge::HORIZONTAL);
+        break;
+    }
+}
+
+void Mmc1Mapper::update_banks() {
+    update_mirroring();
+
+    const uint8_t prg_mode = (control >> 2) & 0x03;
+    const size_t bank16_count = prg_bank_count(0x4000);
+    if (prg_mode == 0 || prg_mode == 1) {
+        const size_t bank32 = ((prg_bank & 0x0E) >> 1) % std::max<size_t>(1, bank16_count / 2);
+        map_prg(0x8000, bank32, 0x8000);
+    } else if (prg_mode == 2) {
+        map_prg(0x8000, 0, 0x4000);
+        map_prg(0xC000, (prg_bank & 0x0F) % bank16_count, 0x4000);
+    } else {
+        map_prg(0x8000, (prg_bank & 0x0F) % bank16_count, 0x4000);
+        map_prg(0xC000, bank16_count - 1, 0x4000);
+    }
+
+    if (((control >> 4) & 0x01) == 0) {
+        map_chr(0x0000, (chr_bank0 & 0x1E) >> 1, 0x2000);
+    } else {
+        map_chr(0x0000, chr_bank0, 0x1000);
+        map_chr(0x1000, chr_bank1, 0x1000);
+    }
+}
+
+bool Mmc1Mapper::cpu_write(uint16_t address, uint8_t data) {
+    if (data & 0x80) {
+        shift = 0x10;
+        control |= 0x0C;
+        update_banks();
+        prg_remapped();
+        return true;
+    }
+
+    const bool complete = (shift & 0x01) != 0;
+    shift >>= 1;
+    shift |= static_cast<uint8_t>((data & 0x01) << 4);
+
+    if (complete) {
+        switch ((address >> 13) & 0x03) {
+        case 0:
+            control = shift;
+            break;
+        case 1:
+            chr_bank0 = shift;
+            break;
+        case 2:
+            chr_bank1 = shift;
+            break;
+        case 3:
+            prg_bank = shift;
+            break;
+        }
+        shift = 0x10;
+        update_banks();
+        prg_remapped();
+    }
+    return true;
+}
+
+void UxromMapper::update_banks() {
+    const size_t bank16_count = prg_bank_count(0x4000);
+    map_prg(0x8000, prg_bank % bank16_count, 0x4000);
+    map_prg(0xC000, bank16_count - 1, 0x4000);
+    map_chr(0x0000, 0, 0x2000);
+}
+
+bool UxromMapper::cpu_write(uint16_t /*address*/, uint8_t data) {
+    prg_bank = data & 0x0F;
+    update_banks();
+    prg_remapped();
+    return true;
+}
+
+void CnromMapper::update_banks() {
+    if (has_one_prg_bank()) {
+        map_prg(0x8000, 0, 0x4000);
+        map_prg(0xC000, 0, 0x4000);
+    } else {
+        map_prg(0x8000, 0, 0x8000);
+    }
+    map_chr(0x0000, chr_bank % chr_bank_count(0x2000), 0x2000);
+}
+
+bool CnromMapper::cpu_write(uint16_t /*address*/, uint8_t data) {
+    chr_bank = data;
+    update_banks();
+    return true;
+}
+
+Mmc3Mapper::Mmc3Mapper(Cartridge& cartridge) : Mapper(cartridge) {
+    ppu_address_watch = true;
+}
+
+void Mmc3Mapper::update_banks() {
+    const size_t bank8_count = prg_bank_count(0x2000);
+    const size_t last = bank8_count - 1;
+    const size_t second_last = bank8_count > 1 ? bank8_count - 2 : last;
+    const size_t bank6 = bank_regs[6] % bank8_count;
+    const size_t bank7 = bank_regs[7] % bank8_count;
+    const bool prg_mode = (bank_select & 0x40) != 0;
+
+    map_prg(0x8000, prg_mode ? second_last : bank6, 0x2000);
+    map_prg(0xA000, bank7, 0x2000);
+    map_prg(0xC000, prg_mode ? bank6 : second_last, 0x2000);
+    map_prg(0xE000, last, 0x2000);
+
+    const size_t bank1_count = chr_bank_count(0x0400);
+    const uint16_t low = (bank_select & 0x80) ? 0x1000 : 0x0000;
+    const uint16_t high = low ^ 0x1000;
+    map_chr(low, (bank_regs[0] & 0xFE) % bank1_count, 0x0400);
+    map_chr(low + 0x0400, ((bank_regs[0] & 0xFE) + 1) % bank1_count, 0x0400);
+    map_chr(low + 0x0800, (bank_regs[1] & 0xFE) % bank1_count, 0x0400);
+    map_chr(low + 0x0C00, ((bank_regs[1] & 0xFE) + 1) % bank1_count, 0x0400);
+    for (uint16_t i = 0; i < 4; i++) {
+        map_chr(high + i * 0x0400, bank_regs[2 + i] % bank1_count, 0x0400);
+    }
+}
+
+bool Mmc3Mapper::cpu_write(uint16_t address, uint8_t data) {
+    if (address <= 0x9FFF) {
+        if ((address & 0x01) == 0) {
+            bank_select = data;
+        } else {
+            bank_regs[bank_select & 0x07] = data;
+        }
+        update_banks();
+        prg_remapped();
+        return true;
+    }
+
+    if (address <= 0xBFFF) {
+        if ((address & 0x01) == 0 && get_mirroring() != Cartridge::FOUR_SCREEN) {
+            set_mirroring((data & 0x01) ? Cartridge::HORIZONTAL : Cartridge::VERTICAL);
+        }
+        return true;
+    }
+
+    if (address <= 0xDFFF) {
+        if ((address & 0x01) == 0) {
+            irq_latch = data;
+        } else {
+            irq_reload = true;
+        }
+        return true;
+    }
+
+    if ((address & 0x01) == 0) {
+        irq_enabled = false;
+        set_irq(false);
+    } else {
+        irq_enabled = true;
+    }
+    return true;
+}
+
+void Mmc3Mapper::a12_changed(bool a12) {
+    if (a12) {
+        if (irq_counter == 0 || irq_reload) {
+            irq_counter = irq_latch;
+        } else {
+            irq_counter--;
+        }
+        if (irq_counter == 0 && irq_enabled) {
+            set_irq(true);
+        }
+        irq_reload = false;
+    }
+    prev_a12 = a12;
+}
+
+int Mmc3Mapper::a12_rises_until_irq() const {
+    if (!irq_enabled || irq_asserted()) {
+        return -1;
+    }
+    return (irq_counter == 0 || irq_reload) ? 1 + irq_latch : irq_counter;
+}
@@ -1,10 +1,13 @@
 #include <ppu.h>
 #include <bus.h>
+#include <mapper.h>
 #include <cstdio>
 #include <algorithm>
+#include <climits>
 #include <cstring>
+#include <type_traits>
 
-static const uint32_t nes_palette[64] = {
+static constexpr uint32_t nes_palette[64] = {
     0x666666FF, 0x002A88FF, 0x1412A7FF, 0x3B00A4FF, 0x5C007EFF,
     0x6E0040FF, 0x6C0600FF, 0x561D00FF,
     0x333500FF, 0x0B4800FF, 0x005200FF, 0x004F08FF, 0x00404DFF,
@@ -23,6 +26,35 @@ static const uint32_t nes_palette[64] = {
     0xB8B8B8FF, 0x000000FF, 0x000000FF,
 };
 
+// nes_palette under each combination of the PPUMASK emphasis bits (red,
+// green, blue from bit 5 up), which darken the channels they do not
+// emphasise. The blacks in columns $xE and $xF stay black.
+struct EmphasisPalettes {
+    uint32_t colors[8][64];
+};
+
+static constexpr uint32_t attenuate(uint32_t channel) { return channel * 3 / 4; }
+
+static constexpr EmphasisPalettes make_emphasis_palettes() {
+    EmphasisPalettes palettes{};
+    for (int emphasis = 0; emphasis < 8; emphasis++) {
+        for (int i = 0; i < 64; i++) {
+            uint32_t r = nes_palette[i] >> 24;
+            uint32_t g = (nes_palette[i] >> 16) & 0xFF;
+            uint32_t b = (nes_palette[i] >> 8) & 0xFF;
+            if ((i & 0x0E) != 0x0E) {
+                if (emphasis & 0x01) { g = attenuate(g); b = attenuate(b); }
+                if (emphasis & 0x02) { r = attenuate(r); b = attenuate(b); }
+                if (emphasis & 0x04) { r = attenuate(r); g = attenuate(g); }
+            }
+            palettes.colors[emphasis][i] = (r << 24) | (g << 16) | (b << 8) | (nes_palette[i] & 0xFF);
+        }
+    }
+    return palettes;
+}
+
+static constexpr EmphasisPalettes emphasis_palettes = make_emphasis_palettes();
+
 static constexpr uint8_t NMI_DELAY_VBLANK_EDGE = 14;
 static constexpr uint8_t NMI_DELAY_IMMEDIATE_ENABLE = 7;
 static constexpr uint8_t NMI_LATCH_WINDOW = 12;
@@ -32,15 +64,9 @@ static inline bool sprite_matches_scanline(uint8_t sprite_y, int16_t target_scan
     return row >= 0 && row < sprite_height;
 }
 
-static inline uint8_t reverse_bits_u8(uint8_t b) {
-    b = (b & 0xF0) >> 4 | (b & 0x0F) << 4;
-    b = (b & 0xCC) >> 2 | (b & 0x33) << 2;
-    b = (b & 0xAA) >> 1 | (b & 0x55) << 1;
-    return b;
-}
-
 PPU::PPU() {
     std::memset(screen, 0, sizeof(screen));
+    connect_cartridge(nullptr);
     reset();
 }
 PPU::~PPU() {}
@@ -119,13 +145,12 @@ void PPU::reset() {
 
     std::fill(std::begin(oam), std::end(oam), 0xFF);
     std::fill(std::begin(palette_ram), std::end(palette_ram), 0);
+    update_palette_colors();
     std::fill(std::begin(vram), std::end(vram), 0);
     std::fill(std::begin(secondary_oam), std::end(secondary_oam), OAM_Entry{0xFF,0xFF,0xFF,0xFF});
     std::fill(std::begin(secondary_oam_next), std::end(secondary_oam_next), OAM_Entry{0xFF,0xFF,0xFF,0xFF});
-    std::fill(std::begin(sprite_shifter_pattern_lo), std::end(sprite_shifter_pattern_lo), 0);
-    std::fill(std::begin(sprite_shifter_pattern_hi), std::end(sprite_shifter_pattern_hi), 0);
-    std::fill(std::begin(sprite_shifter_pattern_lo_next), std::end(sprite_shifter_pattern_lo_next), 0);
-    std::fill(std::begin(sprite_shifter_pattern_hi_next), std::end(sprite_shifter_pattern_hi_next), 0);
+    std::fill(std::begin(sprite_shifter_pattern), std::end(sprite_shifter_pattern), 0);
+    std::fill(std::begin(sprite_shifter_pattern_next), std::end(sprite_shifter_pattern_next), 0);
 }
 
 void PPU::cpu_write(uint16_t address, uint8_t data) {
@@ -141,8 +166,14 @@ void PPU::cpu_write(uint16_t address, uint8_t data) {
             break;
         }
         case 0x0001: // PPUMASK
+        {
+            const bool recolour = ((reg_mask ^ data) & 0xE1) != 0;
             reg_mask = data;
+            if (recolour) {
+                update_palette_colors();
+            }
             break;
+        }
         case 0x0003: // OAMADDR
             oam_addr = data;
             break;
@@ -186,32 +217,15 @@ uint8_t PPU::ppu_read(uint16_t address, bool read_only) {
     if (bus && bus->ppu_read(address, data)) {
         return data;
     }
+    return read_vram(address);
+}
 
-    if (address >= 0x2000 && address <= 0x3EFF) {
-        uint16_t addr = address & 0x0FFF;
-        auto mirror_mode = (bus && bus->cart) ? bus->cart->mirror : Cartridge::HORIZONTAL;
-        uint16_t mapped_addr = 0x0000;
-
-        switch (mirror_mode) {
-        case Cartridge::VERTICAL:
-            mapped_addr = addr & 0x07FF;
-            break;
-        case Cartridge::HORIZONTAL:
-            mapped_addr = ((addr & 0x0800) >> 1) | (addr & 0x03FF);
-            break;
-        case Cartridge::ONESCREEN_LO:
-            mapped_addr = addr & 0x03FF;
-            break;
-        case Cartridge::ONESCREEN_HI:
-            mapped_addr = 0x0400 | (addr & 0x03FF);
-            break;
-        case Cartridge::FOUR_SCREEN:
-        default:
-            mapped_addr = addr & 0x0FFF;
-            break;
-        }
+// Nametables and palette; the cartridge never claims $2000-$3FFF.
+uint8_t PPU::read_vram(uint16_t address) {
+    uint8_t data = 0x00;
 
-        data = vram[mapped_addr & 0x0FFF];
+    if (address >= 0x2000 && address <= 0x3EFF) {
+        data = nametable_pages[(address >> 10) & 0x03][address & 0x03FF];
     }
     else if (address >= 0x3F00 && address <= 0x3FFF) {
         uint16_t pal = address & 0x001F;
@@ -233,30 +247,7 @@ void PPU::ppu_write(uint16_t address, uint8_t data) {
     }
 
     if (address >= 0x2000 && address <= 0x3EFF) {
-        uint16_t addr = address & 0x0FFF;
-        auto mirror_mode = (bus && bus->cart) ? bus->cart->mirror : Cartridge::HORIZONTAL;
-        uint16_t mapped_addr = 0x0000;
-
-        switch (mirror_mode) {
-        case Cartridge::VERTICAL:
-            mapped_addr = addr & 0x07FF;
-            break;
-        case Cartridge::HORIZONTAL:
-            mapped_addr = ((addr & 0x0800) >> 1) | (addr & 0x03FF);
-            break;
-        case Cartridge::ONESCREEN_LO:
-            mapped_addr = addr & 0x03FF;
-            break;
-        case Cartridge::ONESCREEN_HI:
-            mapped_addr = 0x0400 | (addr & 0x03FF);
-            break;
-        case Cartridge::FOUR_SCREEN:
-        default:
-            mapped_addr = addr & 0x0FFF;
-            break;
-        }
-
-        vram[mapped_addr & 0x0FFF] = data;
+        nametable_pages[(address >> 10) & 0x03][address & 0x03FF] = data;
     }
     else if (address >= 0x3F00 && address <= 0x3FFF) {
         uint16_t pal = address & 0x001F;
@@ -265,6 +256,16 @@ void PPU::ppu_write(uint16_t address, uint8_t data) {
         if (pal == 0x0018) pal = 0x0008;
         if (pal == 0x001C) pal = 0x000C;
         palette_ram[pal] = data;
+        update_palette_colors();
+    }
+}
+
+// Palette RAM resolved through greyscale and emphasis, by palette address.
+void PPU::update_palette_colors() {
+    const uint32_t* colors = emphasis_palettes.colors[reg_mask >> 5];
+    const uint8_t grey = (reg_mask & 0x01) ? 0x30 : 0x3F;
+    for (uint16_t i = 0; i < 32; i++) {
+        palette_colors[i] = colors[read_vram(0x3F00 + i) & grey];
     }
 }
 
@@ -312,18 +313,14 @@ void PPU::transfer_address_y() {
 }
 
 void PPU::load_background_shifters() {
-    bg_shifter_pattern_lo = (bg_shifter_pattern_lo & 0xFF00) | bg_next_tile_lsb;
-    bg_shifter_pattern_hi = (bg_shifter_pattern_hi & 0xFF00) | bg_next_tile_msb;
-    bg_shifter_attrib_lo  = (bg_shifter_attrib_lo & 0xFF00) | ((bg_next_tile_attrib & 0b01) ? 0xFF : 0x00);
-    bg_shifter_attrib_hi  = (bg_shifter_attrib_hi & 0xFF00) | ((bg_next_tile_attrib & 0b10) ? 0xFF : 0x00);
+    bg_shifter_pattern = (bg_shifter_pattern & 0xFFFF0000) | bg_next_tile_row;
+    bg_shifter_attrib  = (bg_shifter_attrib & 0xFFFF0000) | (bg_next_tile_attrib * 0x5555u);
 }
 
 void PPU::update_shifters() {
     if (reg_mask & 0x08) {
-        bg_shifter_pattern_hi <<= 1;
-        bg_shifter_pattern_lo <<= 1;
-        bg_shifter_attrib_lo <<= 1;
-        bg_shifter_attrib_hi <<= 1;
+        bg_shifter_pattern <<= 2;
+        bg_shifter_attrib <<= 2;
     }
 }
 
@@ -344,7 +341,124 @@ void PPU::update_nmi_state(bool immediate_enable) {
     nmi_previous = nmi_now;
 }
 
+template <class MapperType>
+uint8_t PPU::fetch(uint16_t address) {
+    if constexpr (std::is_same<MapperType, Mapper>::value) {
+        return ppu_read(address);
+    } else {
+        address &= 0x3FFF;
+        if (address < 0x2000) {
+            MapperType& concrete = static_cast<MapperType&>(*mapper);
+            if constexpr (MapperType::watches_a12) {
+                concrete.ppu_address(address);
+            }
+            return concrete.chr_slot(address)[address & 0x03FF];
+        }
+        return read_vram(address);
+    }
+}
+
+// A pattern row is fetched in one go from the decoded copy of CHR, or from
+// both planes through Bus and Cartridge when not specialised.
+template <class MapperType>
+uint16_t PPU::fetch_row(uint16_t address, bool flip) {
+    if constexpr (std::is_same<MapperType, Mapper>::value) {
+        const uint8_t lo = ppu_read(address);
+        return Cartridge::decode_chr_row(lo, ppu_read(address + 8), flip);
+    } else {
+        MapperType& concrete = static_cast<MapperType&>(*mapper);
+        if constexpr (MapperType::watches_a12) {
+            concrete.ppu_address(address);
+        }
+        return concrete.chr_row(address, flip);
+    }
+}
+
+// Without a cartridge the nametables are mirrored horizontally.
+void PPU::connect_cartridge(Cartridge* cartridge) {
+    if (cart) {
+        cart->connect_nametables(nullptr, nullptr);
+    }
+    cart = cartridge;
+    mapper = cart ? cart->get_mapper() : nullptr;
+    update_mapper_dispatch();
+    if (cart) {
+        cart->connect_nametables(vram, nametable_pages);
+    } else {
+        nametable_pages[0] = nametable_pages[1] = vram;
+        nametable_pages[2] = nametable_pages[3] = vram + 0x0400;
+    }
+}
+
+bool PPU::set_compose_kernel(ComposeKernel kernel) {
+    const ComposeLine line = compose_kernel(kernel);
+    if (line) {
+        compose_line = line;
+    }
+    return line != nullptr;
+}
+
+void PPU::set_mapper_specialisation(bool enabled) {
+    mapper_specialisation = enabled;
+    update_mapper_dispatch();
+}
+
+void PPU::update_mapper_dispatch() {
+    mapper_dispatch = (mapper && mapper_specialisation) ? cart->get_mapper_id() : -1;
+}
+
 void PPU::clock() {
+    switch (mapper_dispatch) {
+    case 0:
+        clock_dot<NromMapper>();
+        break;
+    case 1:
+        clock_dot<Mmc1Mapper>();
+        break;
+    case 2:
+        clock_dot<UxromMapper>();
+        break;
+    case 3:
+        clock_dot<CnromMapper>();
+        break;
+    case 4:
+        clock_dot<Mmc3Mapper>();
+        break;
+    default:
+        clock_dot<Mapper>();
+        break;
+    }
+}
+
+void PPU::evaluate_next_sprites() {
+    for (auto &entry : secondary_oam_next) entry = {0xFF, 0xFF, 0xFF, 0xFF};
+    sprite_count_next = 0;
+    sprite_zero_hit_possible_next = false;
+    std::fill(std::begin(sprite_shifter_pattern_next), std::end(sprite_shifter_pattern_next), 0);
+
+    if (reg_mask & 0x18) {
+        uint8_t sprite_height = (reg_ctrl & 0x20) ? 16 : 8;
+        int16_t eval_scanline = scanline + 1;
+
+        for (uint8_t i = 0; i < 64; i++) {
+            if (!sprite_matches_scanline(oam[i * 4 + 0], eval_scanline, sprite_height)) {
+                continue;
+            }
+
+            if (sprite_count_next < 8) {
+                if (i == 0) {
+                    sprite_zero_hit_possible_next = true;
+                }
+                secondary_oam_next[sprite_count_next] = *(OAM_Entry*)&oam[i * 4];
+                sprite_count_next++;
+            }
+        }
+
+    }
+}
+
+template <class MapperType>
+void PPU::clock_dot() {
     if (overflow_set_pending) {
         reg_status |= 0x20;
         overflow_set_pending = false;
@@ -414,8 +528,7 @@ void PPU::clock() {
         sprite_zero_hit_possible = sprite_zero_hit_possible_next;
         for (uint8_t i = 0; i < 8; i++) {
             secondary_oam[i] = secondary_oam_next[i];
-            sprite_shifter_pattern_lo[i] = sprite_shifter_pattern_lo_next[i];
-            sprite_shifter_pattern_hi[i] = sprite_shifter_pattern_hi_next[i];
+            sprite_shifter_pattern[i] = sprite_shifter_pattern_next[i];
         }
     }
 
@@ -433,19 +546,16 @@ void PPU::clock() {
             switch ((cycle - 1) % 8) {
                 case 0:
                     load_background_shifters();
-                    bg_next_tile_id = ppu_read(0x2000 | (vram_addr_v & 0x0FFF));
+                    bg_next_tile_id = fetch<MapperType>(0x2000 | (vram_addr_v & 0x0FFF));
                     break;
                 case 2:
-                    bg_next_tile_attrib = ppu_read(0x23C0 | (vram_addr_v & 0x0C00) | ((vram_addr_v >> 4) & 0x38) | ((vram_addr_v >> 2) & 0x07));
+                    bg_next_tile_attrib = fetch<MapperType>(0x23C0 | (vram_addr_v & 0x0C00) | ((vram_addr_v >> 4) & 0x38) | ((vram_addr_v >> 2) & 0x07));
                     if (vram_addr_v & 0x0040) bg_next_tile_attrib >>= 4;
                     if (vram_addr_v & 0x0002) bg_next_tile_attrib >>= 2;
                     bg_next_tile_attrib &= 0x03;
                     break;
                 case 4:
-                    bg_next_tile_lsb = ppu_read(((uint16_t)(reg_ctrl & 0x10) << 8) + ((uint16_t)bg_next_tile_id << 4) + ((vram_addr_v >> 12) & 0x07));
-                    break;
-                case 6:
-                    bg_next_tile_msb = ppu_read(((uint16_t)(reg_ctrl & 0x10) << 8) + ((uint16_t)bg_next_tile_id << 4) + ((vram_addr_v >> 12) & 0x07) + 8);
+                    bg_next_tile_row = fetch_row<MapperType>(((uint16_t)(reg_ctrl & 0x10) << 8) + ((uint16_t)bg_next_tile_id << 4) + ((vram_addr_v >> 12) & 0x07), false);
                     break;
                 case 7:
                     if (reg_mask & 0x18) increment_scroll_x();
@@ -454,31 +564,7 @@ void PPU::clock() {
         }
 
         if (cycle == 255) {
-            for (auto &entry : secondary_oam_next) entry = {0xFF, 0xFF, 0xFF, 0xFF};
-            sprite_count_next = 0;
-            sprite_zero_hit_possible_next = false;
-            std::fill(std::begin(sprite_shifter_pattern_lo_next), std::end(sprite_shifter_pattern_lo_next), 0);
-            std::fill(std::begin(sprite_shifter_pattern_hi_next), std::end(sprite_shifter_pattern_hi_next), 0);
-
-            if (reg_mask & 0x18) {
-                uint8_t sprite_height = (reg_ctrl & 0x20) ? 16 : 8;
-                int16_t eval_scanline = scanline + 1;
-
-                for (uint8_t i = 0; i < 64; i++) {
-                    if (!sprite_matches_scanline(oam[i * 4 + 0], eval_scanline, sprite_height)) {
-                        continue;
-                    }
-
-                    if (sprite_count_next < 8) {
-                        if (i == 0) {
-                            sprite_zero_hit_possible_next = true;
-                        }
-                        secondary_oam_next[sprite_count_next] = *(OAM_Entry*)&oam[i * 4];
-                        sprite_count_next++;
-                    }
-                }
-
-            }
+            evaluate_next_sprites();
         }
 
         if (cycle == 256 && (reg_mask & 0x18)) {
@@ -494,7 +580,7 @@ void PPU::clock() {
 
         if (cycle == 340) {
             for (uint8_t i = 0; i < sprite_count_next; i++) {
-                uint16_t addr_lo, addr_hi;
+                uint16_t addr_lo;
                 uint8_t sprite_height = (reg_ctrl & 0x20) ? 16 : 8;
                 bool flip_vert = (secondary_oam_next[i].attribute & 0x80);
                 bool flip_horz = (secondary_oam_next[i].attribute & 0x40);
@@ -502,8 +588,7 @@ void PPU::clock() {
 
                 int16_t row_in_sprite = fetch_scanline - secondary_oam_next[i].y - 1;
                 if (row_in_sprite < 0 || row_in_sprite >= sprite_height) {
-                    sprite_shifter_pattern_lo_next[i] = 0;
-                    sprite_shifter_pattern_hi_next[i] = 0;
+                    sprite_shifter_pattern_next[i] = 0;
                     continue;
                 }
                 if (flip_vert) {
@@ -522,18 +607,8 @@ void PPU::clock() {
                     }
                     addr_lo = pattern_table + (tile_index * 16) + (uint16_t)row_in_sprite;
                 }
-                addr_hi = addr_lo + 8;
-
-                uint8_t bits_lo = ppu_read(addr_lo);
-                uint8_t bits_hi = ppu_read(addr_hi);
-
-                if (flip_horz) {
-                    bits_lo = reverse_bits_u8(bits_lo);
-                    bits_hi = reverse_bits_u8(bits_hi);
-                }
 
-                sprite_shifter_pattern_lo_next[i] = bits_lo;
-                sprite_shifter_pattern_hi_next[i] = bits_hi;
+                sprite_shifter_pattern_next[i] = fetch_row<MapperType>(addr_lo, flip_horz);
             }
         }
     }
@@ -549,9 +624,9 @@ void PPU::clock() {
 
     uint8_t bg_pixel = 0, bg_palette = 0;
     if (reg_mask & 0x08) {
-        uint16_t bit_mux = 0x8000 >> fine_x_scroll;
-        bg_pixel = (((bg_shifter_pattern_hi & bit_mux) > 0) << 1) | ((bg_shifter_pattern_lo & bit_mux) > 0);
-        bg_palette = (((bg_shifter_attrib_hi & bit_mux) > 0) << 1) | ((bg_shifter_attrib_lo & bit_mux) > 0);
+        const int shift = 30 - 2 * fine_x_scroll;
+        bg_pixel = (bg_shifter_pattern >> shift) & 0x03;
+        bg_palette = (bg_shifter_attrib >> shift) & 0x03;
     }
     if (!(reg_mask & 0x02) && cycle >= 1 && cycle <= 8) {
         bg_pixel = 0;
@@ -563,7 +638,7 @@ void PPU::clock() {
     if (reg_mask & 0x10) {
         for (uint8_t i = 0; i < sprite_count; i++) {
             if (secondary_oam[i].x == 0) {
-                uint8_t pixel_val = ((((sprite_shifter_pattern_hi[i] & 0x80) > 0) << 1) | ((sprite_shifter_pattern_lo[i] & 0x80) > 0));
+                uint8_t pixel_val = sprite_shifter_pattern[i] >> 14;
                 if (pixel_val != 0) {
                     sprite_pixel = pixel_val;
                     sprite_palette = (secondary_oam[i].attribute & 0x03) + 4;
@@ -598,10 +673,8 @@ void PPU::clock() {
     }
 
     if (cycle - 1 >= 0 && cycle - 1 < 256 && scanline >= 0 && scanline < 240) {
-        uint16_t palette_address = 0x3F00 + (final_palette << 2) + final_pixel;
-        if (final_pixel == 0) palette_address = 0x3F00;
-        uint8_t color_index = ppu_read(palette_address);
-        screen[scanline * 256 + (cycle - 1)] = nes_palette[color_index & 0x3F];
+        const uint8_t palette_index = final_pixel == 0 ? 0 : (final_palette << 2) + final_pixel;
+        screen[scanline * 256 + (cycle - 1)] = palette_colors[palette_index];
     }
 
     if (cycle >= 1 && cycle <= 256 && (reg_mask & 0x10)) {
@@ -609,8 +682,7 @@ void PPU::clock() {
             if (secondary_oam[i].x > 0) {
                 secondary_oam[i].x--;
             } else {
-                sprite_shifter_pattern_lo[i] <<= 1;
-                sprite_shifter_pattern_hi[i] <<= 1;
+                sprite_shifter_pattern[i] <<= 2;
             }
         }
     }
@@ -632,11 +704,198 @@ void PPU::clock() {
         if (scanline > 260) {
             scanline = -1;
             frame_complete = true;
+            if (frame_log) {
+                frame_log->insert(frame_log->end(), screen, screen + 256 * 240);
+            }
             odd_frame = !odd_frame;
         }
     }
 }
 
+bool PPU::clock_line() {
+    if (!scanline_renderer || cycle != 1 || scanline < 0 || scanline >= 240 || nmi_delay > 0) {
+        return false;
+    }
+    switch (mapper_dispatch) {
+    case 0:
+        render_line<NromMapper>();
+        break;
+    case 1:
+        render_line<Mmc1Mapper>();
+        break;
+    case 2:
+        render_line<UxromMapper>();
+        break;
+    case 3:
+        render_line<CnromMapper>();
+        break;
+    case 4:
+        render_line<Mmc3Mapper>();
+        break;
+    default:
+        render_line<Mapper>();
+        break;
+    }
+    return true;
+}
+
+// clock_dot() for dots 1-256 of lines 0-239, rearranged: the background a
+// tile at a time with the same fetches in the same order, the sprites
+// unpacked into a line buffer up front, then the pixels composed in one pass
+// by a compose.h kernel and looked up in palette_colors.
+// Nothing the CPU can change is read in between, so the order of the rest
+// does not matter.
+template <class MapperType>
+void PPU::render_line() {
+    const bool show_bg = (reg_mask & 0x08) != 0;
+    const bool show_sprites = (reg_mask & 0x10) != 0;
+    const bool rendering = (reg_mask & 0x18) != 0;
+    const uint16_t bg_table = (uint16_t)(reg_ctrl & 0x10) << 8;
+
+    // Palette index per pixel (palette << 2 | pixel), 0 where transparent.
+    uint8_t bg_line[256];
+    for (int tile = 0; tile < 32; tile++) {
+        if (tile > 0) {
+            update_shifters();
+        }
+        load_background_shifters();
+        bg_next_tile_id = read_vram(0x2000 | (vram_addr_v & 0x0FFF));
+        bg_next_tile_attrib = read_vram(0x23C0 | (vram_addr_v & 0x0C00) | ((vram_addr_v >> 4) & 0x38) | ((vram_addr_v >> 2) & 0x07));
+        if (vram_addr_v & 0x0040) bg_next_tile_attrib >>= 4;
+        if (vram_addr_v & 0x0002) bg_next_tile_attrib >>= 2;
+        bg_next_tile_attrib &= 0x03;
+        const uint16_t pattern = bg_table + ((uint16_t)bg_next_tile_id << 4) + ((vram_addr_v >> 12) & 0x07);
+        bg_next_tile_row = fetch_row<MapperType>(pattern, false);
+
+        uint8_t* out = bg_line + tile * 8;
+        if (show_bg) {
+            for (int i = 0; i < 8; i++) {
+                const int shift = 30 - 2 * (fine_x_scroll + i);
+                out[i] = (((bg_shifter_attrib >> shift) & 0x03) << 2) | ((bg_shifter_pattern >> shift) & 0x03);
+            }
+            bg_shifter_pattern <<= 14;
+            bg_shifter_attrib <<= 14;
+        } else {
+            std::fill(out, out + 8, 0);
+        }
+        if (rendering) increment_scroll_x();
+    }
+
+    if (overflow_set_cycle >= 1 && overflow_set_cycle <= 255) {
+        reg_status |= 0x20;
+    } else if (overflow_set_cycle == 256) {
+        overflow_set_pending = true;
+    }
+
+    // Sprite palette index per pixel, bit 5 for priority over the
+    // background and bit 6 for sprite 0; earlier sprites win.
+    uint8_t sprite_line[256] = {};
+    if (show_sprites) {
+        for (int i = sprite_count - 1; i >= 0; i--) {
+            const int x = secondary_oam[i].x;
+            const uint16_t row = sprite_shifter_pattern[i];
+            const uint8_t flags = 0x10 | ((secondary_oam[i].attribute & 0x03) << 2) |
+                                  ((secondary_oam[i].attribute & 0x20) ? 0x00 : 0x20) | (i == 0 ? 0x40 : 0x00);
+            for (int j = 0; j < 8 && x + j < 256; j++) {
+                const uint8_t pixel = (row >> (14 - 2 * j)) & 0x03;
+                if (pixel != 0) {
+                    sprite_line[x + j] = flags | pixel;
+                }
+            }
+            const int shifts = 256 - x;
+            secondary_oam[i].x = 0;
+            sprite_shifter_pattern[i] = shifts < 8 ? (uint16_t)(row << (2 * shifts)) : 0;
+        }
+    }
+
+    uint8_t pixels[256];
+    if (compose_line(bg_line, sprite_line, reg_mask, pixels) && sprite_zero_hit_possible && (reg_mask & 0x18) == 0x18) {
+        reg_status |= 0x40;
+    }
+    uint32_t* row = screen + scanline * 256;
+    for (int x = 0; x < 256; x++) {
+        row[x] = palette_colors[pixels[x]];
+    }
+    sprite_zero_being_rendered = (sprite_line[255] & 0x40) != 0;
+
+    evaluate_next_sprites();
+    if (rendering) increment_scroll_y();
+    cycle = 257;
+}
+
+int PPU::dots_until_vblank_event() const {
+    // A raised flag has not been read yet, so the next poll is already the event.
+    if (nmi_delay > 0 || (reg_status & 0x80)) {
+        return 0;
+    }
+    const int dot = (scanline + 1) * 341 + cycle;
+    const int vblank_set = (241 + 1) * 341 + 1;
+    const int frame_start = 262 * 341;
+    // The skipped odd-frame dot can only bring the event one dot closer.
+    return (dot <= vblank_set ? vblank_set - dot : frame_start - dot) - 1;
+}
+
+int PPU::dots_until_nmi() const {
+    if (nmi_delay > 0) {
+        return 0;
+    }
+    const int dot = (scanline + 1) * 341 + cycle;
+    const int vblank_set = (241 + 1) * 341 + 1;
+    const int frame_dots = 262 * 341;
+    return (vblank_set - dot + frame_dots) % frame_dots;
+}
+
+// Pattern fetches come from one table per kind and line with 8x8 sprites:
+// background at dots 1-256 and 321-336 (the first at dot 5) on lines -1 to
+// 239 whether rendering is on or not, sprites at dot 340. A12 rises at most
+// once a line, at dot 5 from a $1000 background or at dot 340 from $1000
+// sprites over a $0000 background. Register writes that change this sync
+// the PPU and predict again.
+int PPU::dots_until_a12_rise(int rises) const {
+    if (reg_ctrl & 0x20) {
+        return -1;
+    }
+    int rise_cycle = 0;
+    if (reg_ctrl & 0x10) {
+        rise_cycle = 5;
+    } else if (reg_ctrl & 0x08) {
+        rise_cycle = 340;
+    } else {
+        return INT_MAX;
+    }
+    const int frame_dots = 262 * 341;
+    const int fetch_lines = 241;
+    int first_line = scanline + 1 + (cycle > rise_cycle ? 1 : 0);
+    int frames = 0;
+    if (first_line >= fetch_lines) {
+        first_line = 0;
+        frames = 1;
+    }
+    const int line = first_line + rises - 1;
+    frames += line / fetch_lines;
+    const int rise = frames * frame_dots + (line % fetch_lines) * 341 + rise_cycle;
+    // Every pre-render line crossed may be a dot short.
+    return std::max(0, rise - ((scanline + 1) * 341 + cycle) - frames - 1);
+}
+
+// Sprite evaluation reads OAM on the pre-render and visible lines; from the
+// post-render line on, nothing does until the next pre-render line.
+bool PPU::reads_oam_within(int dots) const {
+    if ((reg_mask & 0x18) == 0) {
+        return false;
+    }
+    if (scanline < 240) {
+        return true;
+    }
+    const int dot = (scanline + 1) * 341 + cycle;
+    return 262 * 341 - dot <= dots;
+}
+
+void PPU::write_oam_page(const uint8_t* data) {
+    std::copy(data, data + (256 - oam_addr), oam + oam_addr);
+    std::copy(data + (256 - oam_addr), data + 256, oam);
+}
+
 void PPU::log_status() {
     printf(" PPU:%3d,%3d", scanline, cycle);
 }
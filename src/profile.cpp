@@ -0,0 +1,71 @@
+#include <profile.h>
+#include <cpu.h>
+
+#include <cinttypes>
+#include <cstdio>
+
+bool CpuProfile::write_csv(const std::string& path) const {
+    std::FILE* out = std::fopen(path.c_str(), "w");
+    if (!out) {
+        return false;
+    }
+    std::fprintf(out, "opcode,name,mode,executions,cycles,page_crosses,branches_taken,branches_not_taken\n");
+    for (int opcode = 0; opcode < 256; opcode++) {
+        const OpcodeProfile& entry = opcodes[opcode];
+        if (entry.executions == 0) {
+            continue;
+        }
+        const CPU::Instruction& instruction = CPU::instruction_table[opcode];
+        std::fprintf(out, "%02X,%s,%s,%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 ",%" PRIu64 "\n",
+                     opcode, instruction.name, CPU::mode_name(instruction.mode), entry.executions,
+                     entry.cycles, entry.page_crosses, entry.branches_taken, entry.branches_not_taken);
+    }
+    return std::fclose(out) == 0;
+}
+
+bool CpuProfile::write_json(const std::string& path) const {
+    std::FILE* out = std::fopen(path.c_str(), "w");
+    if (!out) {
+        return false;
+    }
+
+    std::array<OpcodeProfile, static_cast<size_t>(CPU::Mode::REL) + 1> modes{};
+    std::fprintf(out, "{\n  \"opcodes\": [");
+    const char* separator = "\n";
+    for (int opcode = 0; opcode < 256; opcode++) {
+        const OpcodeProfile& entry = opcodes[opcode];
+        if (entry.executions == 0) {
+            continue;
+        }
+        const CPU::Instruction& instruction = CPU::instruction_table[opcode];
+        OpcodeProfile& mode = modes[static_cast<size_t>(instruction.mode)];
+        mode.executions += entry.executions;
+        mode.cycles += entry.cycles;
+        mode.page_crosses += entry.page_crosses;
+        mode.branches_taken += entry.branches_taken;
+        mode.branches_not_taken += entry.branches_not_taken;
+
+        std::fprintf(out, "%s    {\"opcode\": %d, \"name\": \"%s\", \"mode\": \"%s\", \"executions\": %" PRIu64
+                     ", \"cycles\": %" PRIu64 ", \"page_crosses\": %" PRIu64 ", \"branches_taken\": %" PRIu64
+                     ", \"branches_not_taken\": %" PRIu64 "}",
+                     separator, opcode, instruction.name, CPU::mode_name(instruction.mode), entry.executions,
+                     entry.cycles, entry.page_crosses, entry.branches_taken, entry.branches_not_taken);
+        separator = ",\n";
+    }
+
+    std::fprintf(out, "\n  ],\n  \"modes\": [");
+    separator = "\n";
+    for (size_t mode = 0; mode < modes.size(); mode++) {
+        const OpcodeProfile& entry = modes[mode];
+        if (entry.executions == 0) {
+            continue;
+        }
+        std::fprintf(out, "%s    {\"mode\": \"%s\", \"executions\": %" PRIu64 ", \"cycles\": %" PRIu64
+                     ", \"page_crosses\": %" PRIu64 "}",
+                     separator, CPU::mode_name(static_cast<CPU::Mode>(mode)), entry.executions, entry.cycles,
+                     entry.page_crosses);
+        separator = ",\n";
+    }
+    std::fprintf(out, "\n  ]\n}\n");
+    return std::fclose(out) == 0;
+}
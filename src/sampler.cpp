@@ -0,0 +1,102 @@
+#include <sampler.h>
+#include <bus.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <map>
+
+// A location is the CPU address in bits 0-15 and the 8KB PRG ROM bank in bits
+// 16-23 ($FF outside PRG ROM); frames keep the Entry kind in bits 24-25.
+namespace {
+const uint32_t no_bank = 0xFF;
+}
+
+Sampler::Sampler(Bus& bus, uint32_t period)
+    : bus(bus), period(std::max<uint32_t>(period, 1) * 3), countdown(this->period), nodes{{0, 0}} {
+}
+
+uint32_t Sampler::locate(uint16_t address) const {
+    size_t offset = 0;
+    if (bus.cart && bus.cart->prg_rom_offset(address, offset)) {
+        const uint32_t bank = static_cast<uint32_t>(std::min<size_t>(offset >> 13, no_bank - 1));
+        return (bank << 16) | address;
+    }
+    return (no_bank << 16) | address;
+}
+
+void Sampler::sample(uint16_t pc) {
+    // Timestamps are in PPU dots, period and countdown too.
+    const uint64_t now = bus.get_timestamp();
+    if (has_previous) {
+        countdown -= static_cast<int64_t>(now - last_timestamp);
+        if (countdown <= 0) {
+            const int64_t samples = -countdown / period + 1;
+            counts[previous] += static_cast<uint64_t>(samples);
+            countdown += samples * period;
+        }
+    }
+    previous = (static_cast<uint64_t>(current_node()) << 32) | locate(pc);
+    last_timestamp = now;
+    has_previous = true;
+}
+
+void Sampler::enter(Entry entry, uint16_t target, uint8_t stack_pointer) {
+    if (stack.size() == max_depth) {
+        return;
+    }
+    const uint32_t frame = (static_cast<uint32_t>(entry) << 24) | locate(target);
+    const uint32_t parent = current_node();
+    auto child = children.try_emplace((static_cast<uint64_t>(parent) << 32) | frame,
+                                      static_cast<uint32_t>(nodes.size()));
+    if (child.second) {
+        nodes.push_back({parent, frame});
+    }
+    stack.push_back({child.first->second, stack_pointer});
+}
+
+void Sampler::leave(uint8_t stack_pointer) {
+    while (!stack.empty() && stack.back().stack_pointer <= stack_pointer) {
+        stack.pop_back();
+    }
+}
+
+std::string Sampler::describe(uint32_t frame) {
+    static const char* const prefixes[] = {"", "NMI ", "IRQ ", "BRK "};
+    const uint32_t bank = (frame >> 16) & 0xFF;
+    char text[24];
+    if (bank == no_bank) {
+        std::snprintf(text, sizeof(text), "%s--:%04X", prefixes[(frame >> 24) & 0x03], frame & 0xFFFF);
+    } else {
+        std::snprintf(text, sizeof(text), "%s%02X:%04X", prefixes[(frame >> 24) & 0x03], bank, frame & 0xFFFF);
+    }
+    return text;
+}
+
+bool Sampler::write_folded(const std::string& path) const {
+    std::map<std::string, uint64_t> lines;
+    std::vector<std::string> frames;
+    for (const auto& entry : counts) {
+        frames.clear();
+        for (uint32_t node = static_cast<uint32_t>(entry.first >> 32); node != 0; node = nodes[node].parent) {
+            frames.push_back(describe(nodes[node].frame));
+        }
+        std::string line = "reset";
+        for (auto frame = frames.rbegin(); frame != frames.rend(); ++frame) {
+            line += ';';
+            line += *frame;
+        }
+        line += ';';
+        line += describe(static_cast<uint32_t>(entry.first));
+        lines[line] += entry.second;
+    }
+
+    std::FILE* out = std::fopen(path.c_str(), "w");
+    if (!out) {
+        return false;
+    }
+    for (const auto& line : lines) {
+        std::fprintf(out, "%s %" PRIu64 "\n", line.first.c_str(), line.second);
+    }
+    return std::fclose(out) == 0;
+}
@@ -0,0 +1,165 @@
+#include <trace.h>
+#include <cpu.h>
+
+#include <cinttypes>
+#include <cstring>
+
+namespace {
+
+void format_operand(const TraceRecord& r, const CPU::Instruction& instruction, char* out, size_t size) {
+    const uint8_t zp = r.bytes[1];
+    const uint16_t absolute = static_cast<uint16_t>(r.bytes[1] | (r.bytes[2] << 8));
+    switch (instruction.mode) {
+    case CPU::Mode::ACC:
+        std::snprintf(out, size, "A");
+        break;
+    case CPU::Mode::IMM:
+        std::snprintf(out, size, "#$%02X", zp);
+        break;
+    case CPU::Mode::ZP0:
+        std::snprintf(out, size, "$%02X = %02X", zp, r.value);
+        break;
+    case CPU::Mode::ZPX:
+    case CPU::Mode::ZPY:
+        std::snprintf(out, size, "$%02X,%c @ %02X = %02X", zp,
+                      instruction.mode == CPU::Mode::ZPX ? 'X' : 'Y', r.address, r.value);
+        break;
+    case CPU::Mode::ABS:
+        if (instruction.kind == CPU::Kind::JUMP) {
+            std::snprintf(out, size, "$%04X", absolute);
+        } else {
+            std::snprintf(out, size, "$%04X = %02X", absolute, r.value);
+        }
+        break;
+    case CPU::Mode::ABX:
+    case CPU::Mode::ABY:
+        std::snprintf(out, size, "$%04X,%c @ %04X = %02X", absolute,
+                      instruction.mode == CPU::Mode::ABX ? 'X' : 'Y', r.address, r.value);
+        break;
+    case CPU::Mode::IND:
+        std::snprintf(out, size, "($%04X) = %04X", absolute, r.address);
+        break;
+    case CPU::Mode::IZX:
+        std::snprintf(out, size, "($%02X,X) @ %02X = %04X = %02X", zp,
+                      static_cast<uint8_t>(zp + r.x), r.address, r.value);
+        break;
+    case CPU::Mode::IZY:
+        std::snprintf(out, size, "($%02X),Y = %04X @ %04X = %02X", zp, r.pointer, r.address, r.value);
+        break;
+    case CPU::Mode::REL:
+        std::snprintf(out, size, "$%04X", r.address);
+        break;
+    default:
+        out[0] = '\0';
+        break;
+    }
+}
+
+} // namespace
+
+constexpr char Tracer::magic[8];
+
+Tracer::Tracer(size_t capacity) : buffer(capacity > 0 ? capacity : 1) {
+}
+
+Tracer::~Tracer() {
+    if (file) {
+        flush();
+        std::fclose(file);
+    }
+}
+
+bool Tracer::open(const std::string& path) {
+    if (file) {
+        flush();
+        std::fclose(file);
+    }
+    file = std::fopen(path.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    head = 0;
+    wrapped = false;
+    return write_header(file);
+}
+
+void Tracer::flush() {
+    if (!file) {
+        return;
+    }
+    std::fwrite(buffer.data(), sizeof(TraceRecord), head, file);
+    std::fflush(file);
+    head = 0;
+}
+
+void Tracer::wrap() {
+    if (file) {
+        std::fwrite(buffer.data(), sizeof(TraceRecord), buffer.size(), file);
+    } else {
+        wrapped = true;
+    }
+    head = 0;
+}
+
+bool Tracer::save(const std::string& path) const {
+    std::FILE* out = std::fopen(path.c_str(), "wb");
+    if (!out) {
+        return false;
+    }
+    bool ok = write_header(out);
+    if (wrapped) {
+        ok = ok && std::fwrite(buffer.data() + head, sizeof(TraceRecord), buffer.size() - head, out) == buffer.size() - head;
+    }
+    ok = ok && std::fwrite(buffer.data(), sizeof(TraceRecord), head, out) == head;
+    return std::fclose(out) == 0 && ok;
+}
+
+bool Tracer::write_header(std::FILE* out) {
+    TraceHeader header{};
+    std::memcpy(header.magic, magic, sizeof(header.magic));
+    header.version = version;
+    header.record_size = sizeof(TraceRecord);
+    return std::fwrite(&header, sizeof(header), 1, out) == 1;
+}
+
+bool Tracer::read_header(std::FILE* in) {
+    TraceHeader header{};
+    return std::fread(&header, sizeof(header), 1, in) == 1 &&
+           std::memcmp(header.magic, magic, sizeof(header.magic)) == 0 &&
+           header.version == version && header.record_size == sizeof(TraceRecord);
+}
+
+std::vector<TraceRecord> Tracer::records() const {
+    std::vector<TraceRecord> result;
+    result.reserve(wrapped ? buffer.size() : head);
+    if (wrapped) {
+        result.insert(result.end(), buffer.begin() + head, buffer.end());
+    }
+    result.insert(result.end(), buffer.begin(), buffer.begin() + head);
+    return result;
+}
+
+std::string Tracer::to_nestest_line(const TraceRecord& r) {
+    const CPU::Instruction& instruction = CPU::instruction_table[r.bytes[0]];
+    const uint8_t length = 1 + CPU::operand_bytes(instruction.mode);
+
+    char bytes[10];
+    for (uint8_t i = 0; i < 3; i++) {
+        if (i < length) {
+            std::snprintf(bytes + i * 3, 4, "%02X ", r.bytes[i]);
+        } else {
+            std::snprintf(bytes + i * 3, 4, "   ");
+        }
+    }
+
+    char operand[40];
+    format_operand(r, instruction, operand, sizeof(operand));
+    char disassembly[48];
+    std::snprintf(disassembly, sizeof(disassembly), "%c%s %s",
+                  instruction.kind == CPU::Kind::ILLEGAL ? '*' : ' ', instruction.name, operand);
+
+    char line[128];
+    std::snprintf(line, sizeof(line), "%04X  %s%-32s A:%02X X:%02X Y:%02X P:%02X SP:%02X PPU:%3d,%3d CYC:%" PRIu64,
+                  r.pc, bytes, disassembly, r.a, r.x, r.y, r.p, r.sp, r.scanline, r.dot, r.cycle);
+    return line;
+}
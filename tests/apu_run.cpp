@@ -0,0 +1,179 @@
+// APU batching test: drives two APUs with the same register writes and runs
+// one with APU::run(n) and the other with n calls to APU::clock(), for a
+// spread of n. After every batch the channel, frame counter and filter state,
+// the IRQ line transitions and the output samples must be identical. The ROM
+// only provides the bytes the DMC fetches.
+//
+//   apu_run <rom.nes>
+
+#include <cstdio>
+#include <random>
+#include <vector>
+#include "bus.h"
+#include "cartridge.h"
+
+namespace {
+
+// Static so that RAM starts zeroed on both.
+Bus clocked;
+Bus batched;
+
+struct Write {
+    uint16_t address;
+    uint8_t data;
+};
+
+struct Case {
+    const char* name;
+    std::vector<Write> writes;
+};
+
+// Every case ends with a $4017 write, which restarts the frame counter.
+const Case cases[] = {
+    {"pulse, triangle and noise periods", {
+        {0x4015, 0x0F},
+        {0x4000, 0xBF}, {0x4001, 0x00}, {0x4002, 0x08}, {0x4003, 0x00},
+        {0x4004, 0x5A}, {0x4005, 0xA3}, {0x4006, 0x71}, {0x4007, 0x0B},
+        {0x4008, 0x81}, {0x400A, 0x03}, {0x400B, 0x00},
+        {0x400C, 0x34}, {0x400E, 0x00}, {0x400F, 0x08},
+        {0x4017, 0x00},
+    }},
+    {"long periods and sweeps", {
+        {0x4015, 0x0F},
+        {0x4000, 0x1F}, {0x4001, 0xF9}, {0x4002, 0xFF}, {0x4003, 0x07},
+        {0x4004, 0x9C}, {0x4005, 0x8A}, {0x4006, 0x00}, {0x4007, 0x04},
+        {0x4008, 0x7F}, {0x400A, 0xFF}, {0x400B, 0xF7},
+        {0x400C, 0x0F}, {0x400E, 0x8F}, {0x400F, 0xF8},
+        {0x4017, 0x00},
+    }},
+    {"DMC with IRQ", {
+        {0x4010, 0x8F}, {0x4011, 0x40}, {0x4012, 0x10}, {0x4013, 0x02},
+        {0x4015, 0x1F},
+        {0x4017, 0x40},
+    }},
+    {"slow DMC with IRQ and the frame IRQ", {
+        {0x4010, 0x80}, {0x4012, 0xFF}, {0x4013, 0x01},
+        {0x4015, 0x10},
+        {0x4017, 0x00},
+    }},
+    {"looping DMC", {
+        {0x4010, 0x4A}, {0x4012, 0x00}, {0x4013, 0x04},
+        {0x4015, 0x10},
+        {0x4017, 0x00},
+    }},
+    {"4-step mode", {
+        {0x4015, 0x0F},
+        {0x4000, 0x03}, {0x4003, 0x18}, {0x4008, 0x0F}, {0x400B, 0x18}, {0x400C, 0x05}, {0x400F, 0x18},
+        {0x4017, 0x00},
+    }},
+    {"5-step mode", {
+        {0x4015, 0x0F},
+        {0x4000, 0x03}, {0x4003, 0x18}, {0x4008, 0x0F}, {0x400B, 0x18}, {0x400C, 0x05}, {0x400F, 0x18},
+        {0x4017, 0x80},
+    }},
+    {"$4017 IRQ inhibit", {
+        {0x4015, 0x0F},
+        {0x4000, 0x03}, {0x4003, 0x18},
+        {0x4017, 0x40},
+    }},
+};
+
+// Batch lengths up to longer than a 5-step frame, frame counter steps included.
+const uint32_t batches[] = {1, 2, 3, 5, 8, 13, 29, 113, 341, 1024, 7457, 7456, 14913, 29830, 37282, 40000};
+
+const uint32_t case_cycles = 16 * 37282;
+
+// IRQ line levels the APU drove to since the last call that differ from `line`.
+std::vector<bool> transitions(std::vector<bool>& log, bool& line) {
+    std::vector<bool> result;
+    for (bool asserted : log) {
+        if (asserted != line) {
+            result.push_back(asserted);
+            line = asserted;
+        }
+    }
+    log.clear();
+    return result;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s <rom.nes>\n", argv[0]);
+        return 2;
+    }
+
+    Cartridge clocked_cart(argv[1]);
+    Cartridge batched_cart(argv[1]);
+    clocked.insert_cartridge(&clocked_cart);
+    batched.insert_cartridge(&batched_cart);
+    APU& a = clocked.apu;
+    APU& b = batched.apu;
+    std::vector<bool> a_irqs, b_irqs;
+    std::vector<float> a_samples, b_samples;
+    a.set_irq_log(&a_irqs);
+    b.set_irq_log(&b_irqs);
+    a.set_sample_log(&a_samples);
+    b.set_sample_log(&b_samples);
+
+    std::mt19937 random(1);
+    size_t runs = 0;
+    size_t irqs = 0;
+    for (const Case& test : cases) {
+        a.reset();
+        b.reset();
+        for (const Write& write : test.writes) {
+            a.cpu_write(write.address, write.data);
+            b.cpu_write(write.address, write.data);
+        }
+        bool a_line = false;
+        bool b_line = false;
+        transitions(a_irqs, a_line);
+        transitions(b_irqs, b_line);
+        a_samples.clear();
+        b_samples.clear();
+
+        uint32_t cycles = 0;
+        for (size_t batch = 0; cycles < case_cycles; batch++) {
+            const uint32_t n = batches[random() % (sizeof(batches) / sizeof(batches[0]))];
+            for (uint32_t i = 0; i < n; i++) {
+                a.clock();
+            }
+            b.run(n);
+            cycles += n;
+            runs++;
+
+            if (const char* part = a.state_difference(b)) {
+                std::printf("%s: %s state differs after run(%u), %u cycles in\n", test.name, part, n, cycles);
+                return 1;
+            }
+            const std::vector<bool> a_transitions = transitions(a_irqs, a_line);
+            if (a_transitions != transitions(b_irqs, b_line)) {
+                std::printf("%s: IRQ line transitions differ in run(%u), %u cycles in\n", test.name, n, cycles);
+                return 1;
+            }
+            irqs += a_transitions.size();
+            if (a_samples != b_samples) {
+                std::printf("%s: output samples differ in run(%u), %u cycles in\n", test.name, n, cycles);
+                return 1;
+            }
+            a_samples.clear();
+            b_samples.clear();
+
+            // Acknowledge the frame IRQ and restart a finished DMC sample now and then.
+            if (batch % 7 == 6) {
+                a.cpu_read(0x4015);
+                b.cpu_read(0x4015);
+            }
+            if (batch % 11 == 10) {
+                const uint8_t enable = 0x10 | (random() & 0x0F);
+                a.cpu_write(0x4015, enable);
+                b.cpu_write(0x4015, enable);
+            }
+        }
+    }
+    std::printf("%zu runs and %zu IRQ line transitions over %zu cases match\n", runs, irqs,
+                sizeof(cases) / sizeof(cases[0]));
+    return 0;
+}
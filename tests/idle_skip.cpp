@@ -0,0 +1,173 @@
+// Idle loop test: runs a ROM through Bus::run_until() on two buses, one
+// fast-forwarding polling loops and one running every iteration. Every frame
+// and the CPU state at the entry of every NMI handler must be identical. The
+// fast-forwarded register read log must be the full one minus PPUSTATUS reads
+// that found VBlank clear, which are all a skipped iteration can make.
+// mmc3_test.nes covers loops that wait for an IRQ with I clear.
+//
+//   idle_skip <rom.nes> [frames]
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "bus.h"
+#include "cartridge.h"
+
+namespace {
+
+// Not a multiple of a scanline, so that slices end all over the frame and
+// do not cut every fast-forward short just before VBlank.
+const uint64_t slice_dots = 2003;
+const std::ptrdiff_t frame_pixels = 256 * 240;
+
+// Static so that RAM starts zeroed on both.
+Bus full;
+Bus skipping;
+
+struct Side {
+    explicit Side(Bus& bus) : bus(bus) {}
+
+    Bus& bus;
+    std::vector<Bus::RegisterRead> reads;
+    size_t checked_reads = 0;
+    std::vector<CPU::State> nmis;
+    std::vector<uint32_t> frames;
+
+    bool unchecked_read_before(uint64_t until) const {
+        return checked_reads < reads.size() && reads[checked_reads].timestamp < until;
+    }
+    void drop_checked_reads() {
+        reads.erase(reads.begin(), reads.begin() + static_cast<std::ptrdiff_t>(checked_reads));
+        checked_reads = 0;
+    }
+};
+
+// Walks through START and SELECT presses so that the ROM changes what it draws.
+void set_input(Bus& bus, uint64_t slice) {
+    const uint64_t frame = slice * slice_dots / (262 * 341);
+    bus.controller[0].set_button_state(Controller::START, frame % 90 >= 30 && frame % 90 < 33);
+    bus.controller[0].set_button_state(Controller::SELECT, frame % 90 >= 60 && frame % 90 < 62);
+    bus.controller[0].set_button_state(Controller::DOWN, frame % 45 == 10);
+}
+
+bool skippable(const Bus::RegisterRead& read) {
+    return (read.address & 0xE007) == 0x2002 && !(read.data & 0x80);
+}
+
+void print_read(const char* name, const Bus::RegisterRead& read) {
+    std::printf("  %s $%04X = %02X at %llu\n", name, read.address, read.data,
+                static_cast<unsigned long long>(read.timestamp));
+}
+
+// Matches the reads of both logs before `until`, counting the ones only the
+// full run made in `skipped`.
+bool compare_reads(Side& a, Side& b, uint64_t until, size_t& skipped) {
+    while (a.unchecked_read_before(until)) {
+        const Bus::RegisterRead& x = a.reads[a.checked_reads];
+        if (b.unchecked_read_before(until)) {
+            const Bus::RegisterRead& y = b.reads[b.checked_reads];
+            if (x.timestamp == y.timestamp && x.address == y.address && x.data == y.data) {
+                a.checked_reads++;
+                b.checked_reads++;
+                continue;
+            }
+            if (!skippable(x) || x.timestamp >= y.timestamp) {
+                std::printf("register read differs\n");
+                print_read("full:    ", x);
+                print_read("skipping:", y);
+                return false;
+            }
+        } else if (!skippable(x)) {
+            std::printf("register read only happened on the full run\n");
+            print_read("full:    ", x);
+            return false;
+        }
+        a.checked_reads++;
+        skipped++;
+    }
+    if (b.unchecked_read_before(until)) {
+        std::printf("register read only happened on the skipping run\n");
+        print_read("skipping:", b.reads[b.checked_reads]);
+        return false;
+    }
+    return true;
+}
+
+void print_state(const char* name, const CPU::State& s) {
+    std::printf("  %s PC:%04X A:%02X X:%02X Y:%02X P:%02X SP:%02X at %llu\n", name, s.pc, s.a, s.x, s.y,
+                s.p, s.sp, static_cast<unsigned long long>(s.timestamp));
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s <rom.nes> [frames]\n", argv[0]);
+        return 2;
+    }
+    const int frames = argc > 2 ? std::atoi(argv[2]) : 600;
+
+    Cartridge full_cart(argv[1]);
+    Cartridge skipping_cart(argv[1]);
+    Side a(full);
+    Side b(skipping);
+    full.insert_cartridge(&full_cart);
+    skipping.insert_cartridge(&skipping_cart);
+    full.cpu.set_idle_skip_enabled(false);
+    skipping.cpu.set_idle_skip_enabled(true);
+    for (Side* side : {&a, &b}) {
+        side->bus.cpu.reset();
+        side->bus.ppu.reset();
+        side->bus.apu.reset();
+        side->bus.set_register_log(&side->reads);
+        side->bus.cpu.set_nmi_log(&side->nmis);
+        side->bus.ppu.set_frame_log(&side->frames);
+    }
+
+    int compared = 0;
+    size_t nmis = 0;
+    size_t reads = 0;
+    size_t skipped = 0;
+    for (uint64_t slice = 1; compared < frames; slice++) {
+        const uint64_t target = slice * slice_dots;
+        set_input(full, slice);
+        set_input(skipping, slice);
+        full.run_until(target);
+        skipping.run_until(target);
+
+        const uint64_t until = std::min(full.get_timestamp(), skipping.get_timestamp());
+        if (!compare_reads(a, b, until, skipped)) {
+            return 1;
+        }
+        reads += b.checked_reads;
+        a.drop_checked_reads();
+        b.drop_checked_reads();
+
+        const size_t entries = std::min(a.nmis.size(), b.nmis.size());
+        for (size_t i = 0; i < entries; i++) {
+            if (a.nmis[i] != b.nmis[i]) {
+                std::printf("NMI %zu differs\n", nmis + i);
+                print_state("full:    ", a.nmis[i]);
+                print_state("skipping:", b.nmis[i]);
+                return 1;
+            }
+        }
+        nmis += entries;
+        a.nmis.erase(a.nmis.begin(), a.nmis.begin() + static_cast<std::ptrdiff_t>(entries));
+        b.nmis.erase(b.nmis.begin(), b.nmis.begin() + static_cast<std::ptrdiff_t>(entries));
+
+        while (a.frames.size() >= static_cast<size_t>(frame_pixels) && b.frames.size() >= static_cast<size_t>(frame_pixels)) {
+            if (!std::equal(a.frames.begin(), a.frames.begin() + frame_pixels, b.frames.begin())) {
+                std::printf("frame %d differs\n", compared);
+                return 1;
+            }
+            a.frames.erase(a.frames.begin(), a.frames.begin() + frame_pixels);
+            b.frames.erase(b.frames.begin(), b.frames.begin() + frame_pixels);
+            compared++;
+        }
+    }
+    std::printf("%d frames, %zu NMIs and %zu register reads match, %zu PPUSTATUS reads skipped\n",
+                compared, nmis, reads, skipped);
+    return 0;
+}
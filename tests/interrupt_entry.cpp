@@ -0,0 +1,58 @@
+// Interrupt entry test: runs a ROM that takes every NMI with I clear and
+// checks the status byte each NMI pushed. I must be clear in it, so that RTI
+// turns IRQs back on, B must be clear and bit 5 set.
+//
+//   interrupt_entry <rom.nes> [frames]
+
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "bus.h"
+#include "cartridge.h"
+
+namespace {
+
+// Short enough that nothing pushes over the status before it is checked.
+const uint64_t slice_dots = 341;
+
+// Static so that RAM starts zeroed.
+Bus bus;
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s <rom.nes> [frames]\n", argv[0]);
+        return 2;
+    }
+    const uint64_t frames = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 60;
+
+    Cartridge cart(argv[1]);
+    std::vector<CPU::State> nmis;
+    bus.insert_cartridge(&cart);
+    bus.cpu.reset();
+    bus.ppu.reset();
+    bus.apu.reset();
+    bus.cpu.set_nmi_log(&nmis);
+
+    size_t checked = 0;
+    for (uint64_t slice = 1; slice <= frames * 262; slice++) {
+        bus.run_until(slice * slice_dots);
+        for (const CPU::State& entry : nmis) {
+            const uint8_t pushed = bus.cpu_read(static_cast<uint16_t>(0x0100 | ((entry.sp + 1) & 0xFF)));
+            if ((pushed & (FLAG_I | FLAG_B | FLAG_Ig)) != FLAG_Ig) {
+                std::printf("NMI %zu pushed P:%02X\n  handler PC:%04X P:%02X SP:%02X at %llu\n", checked, pushed,
+                            entry.pc, entry.p, entry.sp, static_cast<unsigned long long>(entry.timestamp));
+                return 1;
+            }
+            checked++;
+        }
+        nmis.clear();
+    }
+    if (checked == 0) {
+        std::printf("no NMI taken\n");
+        return 1;
+    }
+    std::printf("%zu NMIs pushed P with I and B clear\n", checked);
+    return 0;
+}
@@ -0,0 +1,103 @@
+// JIT test: runs a ROM through Bus::run_until() on two buses, one with the
+// JIT compiling hot blocks and one interpreting them. The CPU state after
+// every slice and every PPU/I/O register read must be identical.
+//
+//   jit_compare <rom.nes> [frames]
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "bus.h"
+#include "cartridge.h"
+
+namespace {
+
+const uint64_t slice_dots = 341;
+
+// Static so that RAM starts zeroed on both.
+Bus interpreted;
+Bus compiled;
+
+// Walks through START and SELECT presses so that the ROM runs its tests.
+void set_input(Bus& bus, uint64_t slice) {
+    const uint64_t frame = slice / 262;
+    bus.controller[0].set_button_state(Controller::START, frame % 90 >= 30 && frame % 90 < 33);
+    bus.controller[0].set_button_state(Controller::SELECT, frame % 90 >= 60 && frame % 90 < 62);
+    bus.controller[0].set_button_state(Controller::DOWN, frame % 45 == 10);
+}
+
+void print_state(const char* name, const CPU::State& s) {
+    std::printf("  %s PC:%04X A:%02X X:%02X Y:%02X P:%02X SP:%02X at %llu\n", name, s.pc, s.a, s.x, s.y,
+                s.p, s.sp, static_cast<unsigned long long>(s.timestamp));
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s <rom.nes> [frames]\n", argv[0]);
+        return 2;
+    }
+    const uint64_t frames = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 600;
+
+    Cartridge interpreted_cart(argv[1]);
+    Cartridge compiled_cart(argv[1]);
+    std::vector<Bus::RegisterRead> interpreted_reads;
+    std::vector<Bus::RegisterRead> compiled_reads;
+    interpreted.insert_cartridge(&interpreted_cart);
+    compiled.insert_cartridge(&compiled_cart);
+    interpreted.set_register_log(&interpreted_reads);
+    compiled.set_register_log(&compiled_reads);
+    interpreted.cpu.set_jit_enabled(false);
+    compiled.cpu.set_jit_enabled(true);
+    for (Bus* bus : {&interpreted, &compiled}) {
+        // Keeps every polling read in both logs.
+        bus->cpu.set_idle_skip_enabled(false);
+        bus->cpu.reset();
+        bus->ppu.reset();
+        bus->apu.reset();
+    }
+
+    size_t total_reads = 0;
+    const uint64_t slices = frames * 262;
+    for (uint64_t slice = 1; slice <= slices; slice++) {
+        const uint64_t target = slice * slice_dots;
+        set_input(interpreted, slice);
+        set_input(compiled, slice);
+        interpreted.run_until(target);
+        compiled.run_until(target);
+
+        const size_t reads = std::min(interpreted_reads.size(), compiled_reads.size());
+        for (size_t i = 0; i < reads; i++) {
+            const Bus::RegisterRead& x = interpreted_reads[i];
+            const Bus::RegisterRead& y = compiled_reads[i];
+            if (x.timestamp != y.timestamp || x.address != y.address || x.data != y.data) {
+                std::printf("register read %zu differs\n  interpreted: $%04X = %02X at %llu\n  compiled:    $%04X = %02X at %llu\n",
+                            total_reads + i, x.address, x.data, static_cast<unsigned long long>(x.timestamp),
+                            y.address, y.data, static_cast<unsigned long long>(y.timestamp));
+                return 1;
+            }
+        }
+        if (interpreted_reads.size() != compiled_reads.size()) {
+            std::printf("register read %zu only happened on the %s bus\n", total_reads + reads,
+                        interpreted_reads.size() > compiled_reads.size() ? "interpreted" : "compiled");
+            return 1;
+        }
+        total_reads += reads;
+        interpreted_reads.clear();
+        compiled_reads.clear();
+
+        const CPU::State x = interpreted.cpu.get_state();
+        const CPU::State y = compiled.cpu.get_state();
+        if (x != y) {
+            std::printf("CPU state differs after slice %llu\n", static_cast<unsigned long long>(slice));
+            print_state("interpreted:", x);
+            print_state("compiled:   ", y);
+            return 1;
+        }
+    }
+    std::printf("%llu frames, CPU state and %zu register reads match\n",
+                static_cast<unsigned long long>(frames), total_reads);
+    return 0;
+}
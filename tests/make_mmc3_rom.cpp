@@ -0,0 +1,313 @@
+// Writes a small MMC3 (mapper 4) test ROM for ppu_catch_up, interrupt_entry
+// and idle_skip. Its main loop polls RAM with I clear until the next IRQ. Its
+// program switches CHR and PRG banks, moves sprite 0 and runs the scanline
+// counter IRQ with a different latch every time, and goes through four
+// PPUCTRL setups 32 frames each:
+//
+//   0  8x8 sprites from $1000, background from $0000 (A12 rises predictably)
+//   1  8x16 sprites, background from $0000 (catch-up falls back to every dot)
+//   2  setup 0 and setup 1 swapped by every IRQ, mid-frame
+//   3  8x8 sprites from $0000, background from $1000
+//
+//   make_mmc3_rom <out.nes>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <initializer_list>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace {
+
+// Just enough of a 6502 assembler for the program below; the code goes into
+// the fixed bank at $E000.
+class Assembler {
+public:
+    static constexpr uint16_t origin = 0xE000;
+
+    std::vector<uint8_t> code;
+
+    void bytes(std::initializer_list<uint8_t> values) { code.insert(code.end(), values); }
+    void implied(uint8_t opcode) { bytes({opcode}); }
+    void immediate(uint8_t opcode, uint8_t value) { bytes({opcode, value}); }
+    void zero_page(uint8_t opcode, uint8_t address) { bytes({opcode, address}); }
+    void absolute(uint8_t opcode, uint16_t address) {
+        bytes({opcode, static_cast<uint8_t>(address), static_cast<uint8_t>(address >> 8)});
+    }
+    void absolute(uint8_t opcode, const std::string& label) {
+        absolute(opcode, 0);
+        fixups.push_back({code.size() - 2, label, false});
+    }
+    void branch(uint8_t opcode, const std::string& label) {
+        bytes({opcode, 0});
+        fixups.push_back({code.size() - 1, label, true});
+    }
+    void label(const std::string& name) { labels[name] = address(); }
+    uint16_t address() const { return static_cast<uint16_t>(origin + code.size()); }
+    uint16_t operator[](const std::string& name) const { return labels.at(name); }
+
+    bool resolve() {
+        for (const Fixup& fixup : fixups) {
+            const auto target = labels.find(fixup.label);
+            if (target == labels.end()) {
+                std::fprintf(stderr, "undefined label %s\n", fixup.label.c_str());
+                return false;
+            }
+            if (fixup.relative) {
+                const int offset = target->second - (origin + static_cast<int>(fixup.at) + 1);
+                if (offset < -128 || offset > 127) {
+                    std::fprintf(stderr, "branch to %s out of range\n", fixup.label.c_str());
+                    return false;
+                }
+                code[fixup.at] = static_cast<uint8_t>(offset);
+            } else {
+                code[fixup.at] = static_cast<uint8_t>(target->second);
+                code[fixup.at + 1] = static_cast<uint8_t>(target->second >> 8);
+            }
+        }
+        return true;
+    }
+
+private:
+    struct Fixup {
+        size_t at;
+        std::string label;
+        bool relative;
+    };
+    std::map<std::string, uint16_t> labels;
+    std::vector<Fixup> fixups;
+};
+
+enum Opcode : uint8_t {
+    ADC_IMM = 0x69, AND_IMM = 0x29, BEQ = 0xF0, BIT_ABS = 0x2C, BNE = 0xD0, BPL = 0x10, CLC = 0x18,
+    CLD = 0xD8, CLI = 0x58, CPX_IMM = 0xE0, DEY = 0x88, EOR_IMM = 0x49, INC_ABS = 0xEE, INC_ZP = 0xE6,
+    INX = 0xE8, JMP_ABS = 0x4C, LDA_ABS = 0xAD, LDA_ABX = 0xBD, LDA_IMM = 0xA9, LDA_ZP = 0xA5,
+    LDX_IMM = 0xA2, LDX_ZP = 0xA6, LDY_IMM = 0xA0, LSR_A = 0x4A, PHA = 0x48, PLA = 0x68,
+    RTI = 0x40, SEI = 0x78, STA_ABS = 0x8D, STA_ABX = 0x9D, STA_ZP = 0x85, STX_ABS = 0x8E,
+    STX_ZP = 0x86, TAX = 0xAA, TXA = 0x8A, TXS = 0x9A,
+};
+
+// Zero page variables.
+const uint8_t irq_seen = 0x10;
+const uint8_t frame = 0x12;
+const uint8_t irqs = 0x13;
+const uint8_t ppu_ctrl = 0x20;
+const uint8_t setup = 0x21;
+
+void assemble(Assembler& a) {
+    a.label("reset");
+    a.implied(SEI);
+    a.implied(CLD);
+    a.immediate(LDX_IMM, 0xFF);
+    a.implied(TXS);
+    a.immediate(LDA_IMM, 0x40);
+    a.absolute(STA_ABS, 0x4017);
+    a.immediate(LDA_IMM, 0x00);
+    a.absolute(STA_ABS, 0x2000);
+    a.absolute(STA_ABS, 0x2001);
+    a.label("vblank1");
+    a.absolute(BIT_ABS, 0x2002);
+    a.branch(BPL, "vblank1");
+    a.label("vblank2");
+    a.absolute(BIT_ABS, 0x2002);
+    a.branch(BPL, "vblank2");
+
+    // Palette entry n = n, nametables all tile numbers 0-255 over and over.
+    a.immediate(LDA_IMM, 0x3F);
+    a.absolute(STA_ABS, 0x2006);
+    a.immediate(LDA_IMM, 0x00);
+    a.absolute(STA_ABS, 0x2006);
+    a.immediate(LDX_IMM, 0x00);
+    a.label("palette");
+    a.implied(TXA);
+    a.absolute(STA_ABS, 0x2007);
+    a.implied(INX);
+    a.immediate(CPX_IMM, 0x20);
+    a.branch(BNE, "palette");
+    a.immediate(LDA_IMM, 0x20);
+    a.absolute(STA_ABS, 0x2006);
+    a.immediate(LDA_IMM, 0x00);
+    a.absolute(STA_ABS, 0x2006);
+    a.immediate(LDY_IMM, 0x10);
+    a.label("nametables");
+    a.implied(TXA);
+    a.absolute(STA_ABS, 0x2007);
+    a.implied(INX);
+    a.branch(BNE, "nametables");
+    a.implied(DEY);
+    a.branch(BNE, "nametables");
+
+    // OAM byte n = n: sprite k at Y and X 4k with tile 4k+1, all attributes.
+    a.label("oam");
+    a.implied(TXA);
+    a.absolute(STA_ABX, 0x0200);
+    a.implied(INX);
+    a.branch(BNE, "oam");
+
+    // R0-R7 from the table, vertical mirroring.
+    a.label("banks");
+    a.absolute(STX_ABS, 0x8000);
+    a.absolute(LDA_ABX, "bank_table");
+    a.absolute(STA_ABS, 0x8001);
+    a.implied(INX);
+    a.immediate(CPX_IMM, 0x08);
+    a.branch(BNE, "banks");
+    a.immediate(LDA_IMM, 0x00);
+    a.absolute(STA_ABS, 0xA000);
+
+    // Nothing asserts IRQ yet, and every NMI is taken with I clear.
+    a.implied(CLI);
+    a.immediate(LDA_IMM, 0x88);
+    a.zero_page(STA_ZP, ppu_ctrl);
+    a.absolute(STA_ABS, 0x2000);
+    a.immediate(LDA_IMM, 0x1E);
+    a.absolute(STA_ABS, 0x2001);
+
+    // Waits with I clear for the IRQ handler to set irq_seen, then switches
+    // the $8000 PRG bank.
+    a.label("main");
+    a.immediate(LDA_IMM, 0x00);
+    a.zero_page(STA_ZP, irq_seen);
+    a.label("wait");
+    a.zero_page(LDA_ZP, irq_seen);
+    a.branch(BEQ, "wait");
+    a.immediate(LDA_IMM, 0x06);
+    a.absolute(STA_ABS, 0x8000);
+    a.zero_page(LDA_ZP, frame);
+    a.immediate(AND_IMM, 0x03);
+    a.absolute(STA_ABS, 0x8001);
+    a.absolute(JMP_ABS, "main");
+
+    a.label("nmi");
+    a.implied(PHA);
+    a.implied(TXA);
+    a.implied(PHA);
+    a.zero_page(INC_ZP, frame);
+    a.absolute(INC_ABS, 0x0200);
+    a.absolute(INC_ABS, 0x0203);
+    a.immediate(LDA_IMM, 0x02);
+    a.absolute(STA_ABS, 0x4014);
+    a.zero_page(LDA_ZP, frame);
+    for (int i = 0; i < 5; i++) {
+        a.implied(LSR_A);
+    }
+    a.immediate(AND_IMM, 0x03);
+    a.zero_page(STA_ZP, setup);
+    a.implied(TAX);
+    a.absolute(LDA_ABX, "ctrl_table");
+    a.zero_page(STA_ZP, ppu_ctrl);
+    a.absolute(STA_ABS, 0x2000);
+    a.immediate(LDA_IMM, 0x00);
+    a.absolute(STA_ABS, 0x2005);
+    a.absolute(STA_ABS, 0x2005);
+    a.zero_page(LDA_ZP, frame);
+    a.immediate(AND_IMM, 0x1F);
+    a.implied(CLC);
+    a.immediate(ADC_IMM, 0x08);
+    a.absolute(STA_ABS, 0xC000);
+    a.absolute(STA_ABS, 0xC001);
+    a.absolute(STA_ABS, 0xE001);
+    a.implied(PLA);
+    a.implied(TAX);
+    a.implied(PLA);
+    a.implied(RTI);
+
+    a.label("irq");
+    a.implied(PHA);
+    a.implied(TXA);
+    a.implied(PHA);
+    a.absolute(STA_ABS, 0xE000);
+    a.zero_page(INC_ZP, irqs);
+    a.zero_page(INC_ZP, irq_seen);
+    a.zero_page(LDA_ZP, irqs);
+    a.immediate(AND_IMM, 0x0F);
+    a.implied(CLC);
+    a.immediate(ADC_IMM, 0x05);
+    a.absolute(STA_ABS, 0xC000);
+    a.absolute(STA_ABS, 0xC001);
+    a.absolute(STA_ABS, 0xE001);
+    a.immediate(LDA_IMM, 0x02);
+    a.absolute(STA_ABS, 0x8000);
+    a.zero_page(LDA_ZP, irqs);
+    a.immediate(AND_IMM, 0x1F);
+    a.absolute(STA_ABS, 0x8001);
+    a.zero_page(LDA_ZP, irqs);
+    a.absolute(STA_ABS, 0x2005);
+    a.absolute(STA_ABS, 0x2005);
+    a.zero_page(LDX_ZP, setup);
+    a.immediate(CPX_IMM, 0x02);
+    a.branch(BNE, "irq_done");
+    a.zero_page(LDA_ZP, ppu_ctrl);
+    a.immediate(EOR_IMM, 0x28);
+    a.zero_page(STA_ZP, ppu_ctrl);
+    a.absolute(STA_ABS, 0x2000);
+    a.label("irq_done");
+    a.implied(PLA);
+    a.implied(TAX);
+    a.implied(PLA);
+    a.implied(RTI);
+
+    a.label("bank_table");
+    a.bytes({0x00, 0x02, 0x04, 0x05, 0x06, 0x07, 0x00, 0x01});
+    a.label("ctrl_table");
+    a.bytes({0x88, 0xA0, 0x88, 0x90});
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s <out.nes>\n", argv[0]);
+        return 2;
+    }
+
+    Assembler a;
+    assemble(a);
+    if (!a.resolve()) {
+        return 1;
+    }
+
+    const size_t prg_size = 0x8000;
+    const size_t chr_size = 0x8000;
+    std::vector<uint8_t> rom = {'N', 'E', 'S', 0x1A, prg_size / 0x4000, chr_size / 0x2000, 0x40, 0x00};
+    rom.resize(16);
+    // Pseudo-random PRG and CHR, so that every bank and tile is different.
+    uint32_t state = 0x12345678;
+    const auto next = [&state] {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        return static_cast<uint8_t>(state);
+    };
+    std::vector<uint8_t> prg(prg_size);
+    for (uint8_t& byte : prg) {
+        byte = next();
+    }
+    std::vector<uint8_t> chr(chr_size);
+    for (uint8_t& byte : chr) {
+        byte = next();
+    }
+
+    const size_t fixed = prg_size - 0x2000;
+    std::copy(a.code.begin(), a.code.end(), prg.begin() + static_cast<std::ptrdiff_t>(fixed));
+    for (const auto& vector : {std::make_pair(0xFFFA, "nmi"), std::make_pair(0xFFFC, "reset"),
+                               std::make_pair(0xFFFE, "irq")}) {
+        const uint16_t target = a[vector.second];
+        prg[fixed + (vector.first & 0x1FFF)] = static_cast<uint8_t>(target);
+        prg[fixed + (vector.first & 0x1FFF) + 1] = static_cast<uint8_t>(target >> 8);
+    }
+    rom.insert(rom.end(), prg.begin(), prg.end());
+    rom.insert(rom.end(), chr.begin(), chr.end());
+
+    std::ofstream out(argv[1], std::ios::binary);
+    out.write(reinterpret_cast<const char*>(rom.data()), static_cast<std::streamsize>(rom.size()));
+    if (!out) {
+        std::fprintf(stderr, "cannot write %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
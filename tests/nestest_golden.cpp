@@ -0,0 +1,107 @@
+// Golden trace test: runs nestest.nes from $C000 (automation mode) through
+// Bus::run_until and compares the state before every instruction with
+// nestest.log, including the PPU position and the CPU cycle count. The log
+// is compared up to its first unofficial opcode, which this CPU does not
+// implement. That opcode must then run as a one-byte, two-cycle NOP, the
+// same in both CPU cores.
+//
+//   nestest_golden <nestest.nes> <nestest.log>
+
+#include <cstdio>
+#include <fstream>
+#include <string>
+#include <vector>
+#include "bus.h"
+#include "cartridge.h"
+#include "trace.h"
+
+namespace {
+
+// Static so that RAM starts zeroed, like the console nestest.log was taken on.
+Bus bus;
+
+struct Reference {
+    std::vector<std::string> lines;
+    uint16_t unofficial_pc = 0;
+    uint64_t unofficial_cycle = 0;
+};
+
+Reference read_reference(const char* path) {
+    Reference reference;
+    std::ifstream log(path);
+    std::string line;
+    while (std::getline(log, line)) {
+        if (!line.empty() && line.back() == '\r') {
+            line.pop_back();
+        }
+        // Unofficial opcodes are marked with '*' in front of the mnemonic.
+        if (line.size() > 15 && line[15] == '*') {
+            const size_t cycle = line.find("CYC:");
+            reference.unofficial_pc = static_cast<uint16_t>(std::stoul(line.substr(0, 4), nullptr, 16));
+            reference.unofficial_cycle = cycle == std::string::npos ? 0 : std::stoull(line.substr(cycle + 4));
+            break;
+        }
+        reference.lines.push_back(line);
+    }
+    return reference;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 3) {
+        std::fprintf(stderr, "usage: %s <nestest.nes> <nestest.log>\n", argv[0]);
+        return 2;
+    }
+
+    const Reference golden = read_reference(argv[2]);
+    const std::vector<std::string>& reference = golden.lines;
+    if (reference.empty() || golden.unofficial_cycle == 0) {
+        std::fprintf(stderr, "cannot read %s\n", argv[2]);
+        return 2;
+    }
+
+    Cartridge cart(argv[1]);
+    bus.insert_cartridge(&cart);
+    bus.cpu.reset();
+    bus.ppu.reset();
+    bus.apu.reset();
+    bus.cpu.set_pc(0xC000);
+    // nestest.log was recorded with the PPU starting on scanline 0 rather
+    // than on the pre-render line.
+    for (int dot = 0; dot < 341; dot++) {
+        bus.ppu.clock();
+    }
+
+    // run_until overshoots by at most one scanline worth of instructions.
+    Tracer tracer(reference.size() + 1024);
+    bus.cpu.set_tracer(&tracer);
+    while (tracer.get_count() < reference.size() + 2) {
+        bus.run_until(bus.get_timestamp() + 341);
+    }
+    bus.cpu.set_tracer(nullptr);
+
+    const std::vector<TraceRecord> records = tracer.records();
+    for (size_t i = 0; i < reference.size(); i++) {
+        const std::string line = Tracer::to_nestest_line(records[i]);
+        if (line != reference[i]) {
+            std::printf("mismatch at line %zu\nexpected: %s\nactual:   %s\n",
+                        i + 1, reference[i].c_str(), line.c_str());
+            return 1;
+        }
+    }
+
+    const TraceRecord& unofficial = records[reference.size()];
+    const TraceRecord& next = records[reference.size() + 1];
+    if (unofficial.pc != golden.unofficial_pc || unofficial.cycle != golden.unofficial_cycle ||
+        next.pc != unofficial.pc + 1 || next.cycle != unofficial.cycle + 2) {
+        std::printf("unofficial opcode %02X at %04X, CYC:%llu did not run as a one-byte, two-cycle NOP:\n"
+                    "  next instruction at %04X, CYC:%llu\n",
+                    unofficial.bytes[0], unofficial.pc, static_cast<unsigned long long>(unofficial.cycle),
+                    next.pc, static_cast<unsigned long long>(next.cycle));
+        return 1;
+    }
+    std::printf("%zu lines match nestest.log, unofficial opcode %02X ran as a NOP\n", reference.size(),
+                unofficial.bytes[0]);
+    return 0;
+}
@@ -0,0 +1,131 @@
+// Lazy catch-up test: runs a ROM on two buses, one stepped dot by dot
+// through Bus::clock() (the PPU and APU in lockstep with the CPU) and one
+// through Bus::run_until(), where they only catch up on register accesses
+// and scheduled events. Every PPU/I/O register read must return the same
+// value at the same timestamp, and every frame must be identical.
+//
+//   ppu_catch_up <rom.nes> [frames]
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+#include "bus.h"
+#include "cartridge.h"
+
+namespace {
+
+const uint64_t slice_dots = 341;
+const std::ptrdiff_t frame_pixels = 256 * 240;
+
+// Static so that RAM starts zeroed on both.
+Bus stepped;
+Bus lazy;
+
+struct Side {
+    explicit Side(Bus& bus) : bus(bus) {}
+
+    Bus& bus;
+    std::vector<Bus::RegisterRead> reads;
+    size_t checked_reads = 0;
+    size_t total_reads = 0;
+    // Completed frames back to back, copied by the PPU as each one ends;
+    // run_until() can overshoot a slice into the next frame by a whole OAM DMA.
+    std::vector<uint32_t> frames;
+
+    void drop_checked_reads() {
+        reads.erase(reads.begin(), reads.begin() + static_cast<std::ptrdiff_t>(checked_reads));
+        total_reads += checked_reads;
+        checked_reads = 0;
+    }
+
+    size_t frame_count() const { return frames.size() / frame_pixels; }
+    void drop_frame() { frames.erase(frames.begin(), frames.begin() + frame_pixels); }
+};
+
+// Walks through START and SELECT presses so that the ROM changes what it draws.
+void set_input(Bus& bus, uint64_t slice) {
+    const uint64_t frame = slice / 262;
+    bus.controller[0].set_button_state(Controller::START, frame % 90 >= 30 && frame % 90 < 33);
+    bus.controller[0].set_button_state(Controller::SELECT, frame % 90 >= 60 && frame % 90 < 62);
+    bus.controller[0].set_button_state(Controller::DOWN, frame % 45 == 10);
+}
+
+bool compare_reads(Side& a, Side& b, uint64_t until) {
+    while (a.checked_reads < a.reads.size() && a.reads[a.checked_reads].timestamp < until &&
+           b.checked_reads < b.reads.size() && b.reads[b.checked_reads].timestamp < until) {
+        const Bus::RegisterRead& x = a.reads[a.checked_reads];
+        const Bus::RegisterRead& y = b.reads[b.checked_reads];
+        if (x.timestamp != y.timestamp || x.address != y.address || x.data != y.data) {
+            std::printf("register read %zu differs\n  stepped: $%04X = %02X at %llu\n  lazy:    $%04X = %02X at %llu\n",
+                        a.total_reads + a.checked_reads, x.address, x.data, static_cast<unsigned long long>(x.timestamp),
+                        y.address, y.data, static_cast<unsigned long long>(y.timestamp));
+            return false;
+        }
+        a.checked_reads++;
+        b.checked_reads++;
+    }
+    const bool a_behind = a.checked_reads < a.reads.size() && a.reads[a.checked_reads].timestamp < until;
+    const bool b_behind = b.checked_reads < b.reads.size() && b.reads[b.checked_reads].timestamp < until;
+    if (a_behind != b_behind) {
+        std::printf("register read %zu only happened on the %s bus\n",
+                    a.total_reads + a.checked_reads, a_behind ? "stepped" : "lazy");
+        return false;
+    }
+    return true;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s <rom.nes> [frames]\n", argv[0]);
+        return 2;
+    }
+    const int frames = argc > 2 ? std::atoi(argv[2]) : 120;
+
+    Cartridge stepped_cart(argv[1]);
+    Cartridge lazy_cart(argv[1]);
+    Side a(stepped);
+    Side b(lazy);
+    stepped.insert_cartridge(&stepped_cart);
+    lazy.insert_cartridge(&lazy_cart);
+    // Skipped polling loops would leave reads out of the lazy log.
+    lazy.cpu.set_idle_skip_enabled(false);
+    for (Side* side : {&a, &b}) {
+        side->bus.cpu.reset();
+        side->bus.ppu.reset();
+        side->bus.apu.reset();
+        side->bus.set_register_log(&side->reads);
+        side->bus.ppu.set_frame_log(&side->frames);
+    }
+
+    int compared = 0;
+    for (uint64_t slice = 1; compared < frames; slice++) {
+        const uint64_t target = slice * slice_dots;
+        set_input(stepped, slice);
+        set_input(lazy, slice);
+        while (stepped.get_timestamp() < target) {
+            stepped.clock();
+        }
+        lazy.run_until(target);
+
+        if (!compare_reads(a, b, std::min(stepped.get_timestamp(), lazy.get_timestamp()))) {
+            return 1;
+        }
+        a.drop_checked_reads();
+        b.drop_checked_reads();
+        while (a.frame_count() > 0 && b.frame_count() > 0) {
+            if (!std::equal(a.frames.begin(), a.frames.begin() + frame_pixels, b.frames.begin())) {
+                std::printf("frame %d differs\n", compared);
+                return 1;
+            }
+            a.drop_frame();
+            b.drop_frame();
+            compared++;
+        }
+    }
+    std::printf("%d frames and %zu register reads match\n", compared, a.total_reads);
+    return 0;
+}
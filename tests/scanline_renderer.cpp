@@ -0,0 +1,103 @@
+// Renderer comparison test: runs a ROM through Bus::run_until() drawing every
+// dot with PPU::clock(), then again letting catch-up draw whole visible lines
+// with PPU::clock_line() once per pixel composition kernel the CPU supports,
+// and compares a hash of every frame. Prints the time per frame of each.
+//
+//   scanline_renderer <rom.nes> [frames]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include "bus.h"
+#include "cartridge.h"
+
+namespace {
+
+const size_t frame_pixels = 256 * 240;
+
+// One per run, static so that RAM starts zeroed.
+Bus buses[1 + COMPOSE_KERNEL_COUNT];
+
+uint64_t hash_screen(const uint32_t* screen) {
+    uint64_t hash = 1469598103934665603ull;
+    for (size_t i = 0; i < frame_pixels; i++) {
+        hash ^= screen[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+// Walks through START and SELECT presses so that the ROM changes what it draws.
+void set_input(Bus& bus, int frame) {
+    bus.controller[0].set_button_state(Controller::START, frame % 90 >= 30 && frame % 90 < 33);
+    bus.controller[0].set_button_state(Controller::SELECT, frame % 90 >= 60 && frame % 90 < 62);
+    bus.controller[0].set_button_state(Controller::DOWN, frame % 45 == 10);
+}
+
+struct Run {
+    std::vector<uint64_t> hashes;
+    double ms_per_frame;
+};
+
+Run run(Bus& bus, Cartridge& cart, bool scanline_renderer, ComposeKernel kernel, int frames) {
+    bus.insert_cartridge(&cart);
+    bus.ppu.set_scanline_renderer(scanline_renderer);
+    bus.ppu.set_compose_kernel(kernel);
+    bus.cpu.reset();
+    bus.ppu.reset();
+    bus.apu.reset();
+
+    // Frames are taken from the frame log rather than the screen, which a
+    // run_until() overshoot may already have drawn lines of the next frame into.
+    std::vector<uint32_t> log;
+    bus.ppu.set_frame_log(&log);
+    Run result;
+    const auto start = std::chrono::steady_clock::now();
+    while (static_cast<int>(result.hashes.size()) < frames) {
+        set_input(bus, static_cast<int>(result.hashes.size()));
+        bus.run_until(bus.get_timestamp() + 341);
+        size_t offset = 0;
+        for (; offset + frame_pixels <= log.size(); offset += frame_pixels) {
+            result.hashes.push_back(hash_screen(log.data() + offset));
+        }
+        log.erase(log.begin(), log.begin() + static_cast<std::ptrdiff_t>(offset));
+    }
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    bus.ppu.set_frame_log(nullptr);
+    result.ms_per_frame = std::chrono::duration<double, std::milli>(elapsed).count() / frames;
+    return result;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s <rom.nes> [frames]\n", argv[0]);
+        return 2;
+    }
+    const int frames = argc > 2 ? std::atoi(argv[2]) : 600;
+
+    Cartridge cart(argv[1]);
+    const Run dots = run(buses[0], cart, false, COMPOSE_SCALAR, frames);
+    std::printf("%.3f ms/frame by dots\n", dots.ms_per_frame);
+    for (int kernel = COMPOSE_SCALAR; kernel < COMPOSE_KERNEL_COUNT; kernel++) {
+        const ComposeKernel k = static_cast<ComposeKernel>(kernel);
+        if (!compose_kernel(k)) {
+            continue;
+        }
+        Cartridge line_cart(argv[1]);
+        const Run lines = run(buses[1 + kernel], line_cart, true, k, frames);
+        for (int frame = 0; frame < frames; frame++) {
+            if (dots.hashes[frame] != lines.hashes[frame]) {
+                std::printf("frame %d differs: %016llx by dots, %016llx by lines with %s\n", frame,
+                            static_cast<unsigned long long>(dots.hashes[frame]),
+                            static_cast<unsigned long long>(lines.hashes[frame]), compose_kernel_name(k));
+                return 1;
+            }
+        }
+        std::printf("%.3f ms/frame by lines with %s, %d frames match\n", lines.ms_per_frame,
+                    compose_kernel_name(k), frames);
+    }
+    return 0;
+}
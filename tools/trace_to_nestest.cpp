@@ -0,0 +1,47 @@
+// Renders a binary trace written by Tracer as text in the nestest.log format,
+// so it can be diffed line by line against a reference log.
+//
+//   trace_to_nestest <trace file> [output file]   (stdout by default)
+
+#include <cstdio>
+#include <vector>
+#include "trace.h"
+
+int main(int argc, char* argv[]) {
+    if (argc < 2) {
+        std::fprintf(stderr, "usage: %s <trace file> [output file]\n", argv[0]);
+        return 2;
+    }
+
+    std::FILE* in = std::fopen(argv[1], "rb");
+    if (!in) {
+        std::fprintf(stderr, "cannot open %s\n", argv[1]);
+        return 1;
+    }
+    if (!Tracer::read_header(in)) {
+        std::fprintf(stderr, "%s is not an emuNES trace\n", argv[1]);
+        std::fclose(in);
+        return 1;
+    }
+
+    std::FILE* out = argc > 2 ? std::fopen(argv[2], "w") : stdout;
+    if (!out) {
+        std::fprintf(stderr, "cannot open %s\n", argv[2]);
+        std::fclose(in);
+        return 1;
+    }
+
+    std::vector<TraceRecord> records(1 << 14);
+    size_t count = 0;
+    while ((count = std::fread(records.data(), sizeof(TraceRecord), records.size(), in)) > 0) {
+        for (size_t i = 0; i < count; i++) {
+            std::fprintf(out, "%s\n", Tracer::to_nestest_line(records[i]).c_str());
+        }
+    }
+
+    std::fclose(in);
+    if (out != stdout) {
+        std::fclose(out);
+    }
+    return 0;
+}